@@ -29,6 +29,12 @@
 // ====================================
 // Log control
 // ====================================
+// ALU_NOTRACE : alu.c is built a second time without any log code,
+// used when log is off (see machine_setup)
+#ifdef ALU_NOTRACE
+#define	log_flags	0U
+#define	alu_init	alu_init_notrace
+#endif
 #define	LOG_FILE	log_file
 // disassembly output macro
 //#define	DIS(...)	fprintf (LOG_FILE, __VA_ARGS__)
@@ -41,9 +47,9 @@
 // ====================================
 // CPU state variables
 // ====================================
-static struct {
-  // registers
-  unsigned char A[16], B[16], C[16], D[16], E[16];
+struct alu {
+  // registers, one digit per nibble (digit 0 in bits 0-3)
+  uint64_t A, B, C, D, E;
   // bit registers
   unsigned short KR, SR, fA, fB;
   // R5 ALU register
@@ -51,8 +57,8 @@ static struct {
 
   // EXT signal (used for data exchange)
   unsigned short EXT;
-  unsigned char Sout[16];
-  unsigned char Sin[16];
+  uint64_t Sout;
+  uint64_t Sin;
   unsigned short opcode;
   unsigned char key;
 
@@ -67,13 +73,17 @@ static struct {
   unsigned short flags;
   // cycle digit counter
   unsigned char digit;
-  // CPU cycle counter (used to simulate real CPU frequency)
-  unsigned cycle;
 
   int addr;
   int reset;
   int zero_suppr;
-} cpu;
+  // binary trace on, see alu_trace
+  int trace;
+
+  // registers by id, see ALU_OP
+  uint64_t *reg[6];
+};
+enum {REG_NONE, REG_A, REG_B, REG_C, REG_D, REG_E};
 
 // mask definitions
 typedef struct {
@@ -98,6 +108,23 @@ static const mask_type mask_info[16] = {
     {1, 15,  1,   1}  // MAEX 1
 };
 
+#define DIGIT(r, i)	((unsigned)((r) >> (4 * (i))) & 0x0F)
+#define NIB_LSB	0x1111111111111111ULL
+#define NIB_MSB	0x8888888888888888ULL
+// digit 0 is binary, 1..15 are BCD
+#define BCD_SIX	0x6666666666666660ULL
+
+// digits start..end
+static inline uint64_t digit_mask(unsigned start, unsigned end)
+{
+    if (start > 15 || start > end)
+        return 0;
+    return (~0ULL << (4 * start)) & (~0ULL >> (4 * (15 - end)));
+}
+
+// define to check each packed ALU operation against the scalar one
+//#define ALU_CHECK
+
 // ====================================
 // ALU functions
 // ====================================
@@ -106,33 +133,26 @@ static const mask_type mask_info[16] = {
 enum {ALU_ADD, ALU_SHL, ALU_SUB, ALU_SHR};
 #define	ALU_SHIFT	ALU_SHL
 // ------------------------------------
-static void Alu (unsigned char *dst, unsigned char *srcX, unsigned char *srcY, const mask_type *mask, unsigned char flags) {
+// scalar reference, one digit at a time.
+// x and y are the adder inputs, y with IO and mask constant.
+// Registers are 4 bits : a non BCD digit is truncated.
+static void alu_scalar (struct alu *cpu, uint64_t *dst, uint64_t x, uint64_t y, const mask_type *mask, unsigned char flags) {
     unsigned char carry = 0;
     unsigned char shl = 0;
+    uint64_t out = dst ? *dst : 0;
+    uint64_t sout = 0;
     int i;
-    if (log_flags & LOG_DEBUG) {
-        if (srcX) {LOG ("["); for (i = 15; i >= 0; i--) LOG ("%X", srcX[i]); LOG ("]");}
-        if (srcY) {LOG ("["); for (i = 15; i >= 0; i--) LOG ("%X", srcY[i]); LOG ("]");}
-    }
     for (i = 0; i <= 15; i++) {
-        unsigned char sum = 0, shr = 0;
+        unsigned char sum, shr;
         if (i == mask->start)
             shl = carry = 0;
-        if (srcY)
-            sum = srcY[i];
-        if (!(cpu.flags & FLG_IO_VALID))
-            sum |= cpu.Sin[i];
-        if (i == mask->cpos)
-            sum |= mask->cval;
-        shr = sum;
+        sum = DIGIT(y, i);
+        shr = sum | DIGIT(x, i);
         sum += carry;
         if (flags >= ALU_SUB)
             sum = -sum;
-        if (srcX) {
-            sum += srcX[i];
-            shr |= srcX[i];
-        }
-        cpu.Sout[i] = (sum & 0x0F);
+        sum += DIGIT(x, i);
+        sout |= (uint64_t)(sum & 0x0F) << (4 * i);
         if (!i) {
             if ((carry = (sum >= 0x10)))
                 sum &= 0x0F;
@@ -144,521 +164,763 @@ static void Alu (unsigned char *dst, unsigned char *srcX, unsigned char *srcY, c
                     sum += 10;
             }
         }
+        sum &= 0x0F;
         // write result to destination
         if (i >= mask->start && i <= mask->end) {
             if (i == mask->start)
-                cpu.R5 = sum;
+                cpu->R5 = sum;
             if (dst) {
                 if (flags == ALU_SHL)
-                    dst[i] = shl;
+                    out = (out & ~(0xFULL << (4 * i))) | ((uint64_t)shl << (4 * i));
                 else
                     if (flags == ALU_SHR) {
                         if (i > mask->start)
-                            dst[i-1] = shr;
+                            out = (out & ~(0xFULL << (4 * (i-1)))) | ((uint64_t)shr << (4 * (i-1)));
                         if (i == mask->end)
-                            dst[i] = 0;
+                            out &= ~(0xFULL << (4 * i));
                     } else
-                        dst[i] = sum;
+                        out = (out & ~(0xFULL << (4 * i))) | ((uint64_t)sum << (4 * i));
                 shl = sum;
             }
             if (i == mask->end && !(flags & ALU_SHIFT) && carry)
-                cpu.flags &= ~FLG_COND;
+                cpu->flags &= ~FLG_COND;
         }
     }
+    cpu->Sout = sout;
+    if (dst)
+        *dst = out;
+}
+
+// nibble with bit 3 and (bit 2 or bit 1) : 0xA-0xF
+static inline uint64_t bcd_invalid(uint64_t v)
+{
+    return v & ((v << 1) | (v << 2)) & NIB_MSB & ~0xFULL;
+}
+
+// x + y, no carry in. co : carry out of each digit (bit 0 of the nibble),
+// raw : digits before BCD correction
+static inline uint64_t bcd_add(uint64_t x, uint64_t y, uint64_t *co, uint64_t *raw)
+{
+    uint64_t t1 = x + BCD_SIX;
+    uint64_t t2 = t1 + y;
+    uint64_t c = (((t2 ^ t1 ^ y) & NIB_LSB) >> 4) | ((uint64_t)(t2 < t1) << 60);
+    uint64_t six = (~c & NIB_LSB & ~1ULL) * 6;
+
+    *co = c;
+    // per nibble t2 - 6, without borrow between nibbles
+    *raw = ((t2 | NIB_MSB) - BCD_SIX) ^ ((t2 ^ ~BCD_SIX) & NIB_MSB);
+    return t2 - six;
+}
+
+// x - y, no borrow in
+static inline uint64_t bcd_sub(uint64_t x, uint64_t y, uint64_t *co, uint64_t *raw)
+{
+    uint64_t t1 = x - y;
+    uint64_t c = (((t1 ^ x ^ y) & NIB_LSB) >> 4) | ((uint64_t)(x < y) << 60);
+
+    *co = c;
+    *raw = t1;
+    return t1 - (c & NIB_LSB & ~1ULL) * 6;
+}
+
+// IO output of the adder is only used by IO write, and in log/trace
+#ifdef ALU_CHECK
+#define SOUT_USED(cpu)	1
+#else
+#define SOUT_USED(cpu)	(((cpu)->flags & FLG_IO_VALID) || log_flags || (cpu)->trace)
+#endif
+
+// ALU on packed BCD digits (SWAR). The carry chain restart at mask start :
+// digits below it are computed separately, only for IO output.
+// Always inlined with constant m and flags, see ALU_KERNEL.
+static inline __attribute__((always_inline)) void Alu (struct alu *cpu, uint64_t *dst, const uint64_t *srcX, const uint64_t *srcY, const int m, const unsigned char flags) {
+    const mask_type *mask = &mask_info[m];
+    uint64_t x = srcX ? *srcX : 0;
+    uint64_t y = srcY ? *srcY : 0;
+    uint64_t sum, co, raw;
+    uint64_t range = digit_mask(mask->start, mask->end);
+    uint64_t (*op)(uint64_t, uint64_t, uint64_t *, uint64_t *);
+#ifdef ALU_CHECK
+    struct alu ref = *cpu;
+    uint64_t ref_dst = dst ? *dst : 0;
+#endif
+
+    if (log_flags & LOG_DEBUG) {
+        if (srcX) LOG ("[%016llX]", (unsigned long long)*srcX);
+        if (srcY) LOG ("[%016llX]", (unsigned long long)*srcY);
+    }
+    if (!(cpu->flags & FLG_IO_VALID))
+        y |= cpu->Sin;
+    y |= (uint64_t)mask->cval << (4 * mask->cpos);
+
+    if (bcd_invalid(x) | bcd_invalid(y)) {
+        alu_scalar(cpu, dst, x, y, mask, flags);
+        return;
+    }
+
+    op = flags >= ALU_SUB ? bcd_sub : bcd_add;
+    if (mask->start && mask->start <= 15) {
+        uint64_t low = ~(~0ULL << (4 * mask->start));
+        sum = op(x & ~low, y & ~low, &co, &raw);
+        if (SOUT_USED(cpu)) {
+            uint64_t co_l, raw_l;
+            op(x & low, y & low, &co_l, &raw_l);
+            cpu->Sout = (raw_l & low) | (raw & ~low);
+        }
+    }
+    else {
+        sum = op(x, y, &co, &raw);
+        if (SOUT_USED(cpu))
+            cpu->Sout = raw;
+    }
+
+    if (range) {
+        cpu->R5 = DIGIT(sum, mask->start);
+        if (dst) {
+            uint64_t out;
+            if (flags == ALU_SHL)
+                out = (sum << 4) & ~(0xFULL << (4 * mask->start));
+            else if (flags == ALU_SHR)
+                out = ((x | y) >> 4) & ~(0xFULL << (4 * mask->end));
+            else
+                out = sum;
+            *dst = (*dst & ~range) | (out & range);
+        }
+        if (!(flags & ALU_SHIFT) && DIGIT(co, mask->end))
+            cpu->flags &= ~FLG_COND;
+    }
+
+#ifdef ALU_CHECK
+    alu_scalar(&ref, dst ? &ref_dst : NULL, x, y, mask, flags);
+    if (ref.Sout != cpu->Sout || ref.R5 != cpu->R5 || ref.flags != cpu->flags ||
+            (dst && ref_dst != *dst)) {
+        fprintf(stderr, "alu check %04X: x=%016llX y=%016llX\n", cpu->opcode,
+                (unsigned long long)x, (unsigned long long)y);
+        abort();
+    }
+#endif
+}
+
+// ALU kernels, one per mask and operation : mask bounds and constant
+// are resolved at compile time
+typedef void (*alu_fn)(struct alu *cpu, uint64_t *dst, const uint64_t *srcX, const uint64_t *srcY);
+#define ALU_KERNEL(m, op) \
+static void alu_##m##_##op (struct alu *cpu, uint64_t *dst, const uint64_t *srcX, const uint64_t *srcY) { \
+    Alu (cpu, dst, srcX, srcY, m, op); \
 }
+#define ALU_KERNELS(m) \
+    ALU_KERNEL(m, ALU_ADD) ALU_KERNEL(m, ALU_SHL) \
+    ALU_KERNEL(m, ALU_SUB) ALU_KERNEL(m, ALU_SHR)
+#define ALU_KERNEL_ROW(m) \
+    {alu_##m##_ALU_ADD, alu_##m##_ALU_SHL, alu_##m##_ALU_SUB, alu_##m##_ALU_SHR}
+
+ALU_KERNELS(0) ALU_KERNELS(1) ALU_KERNELS(2) ALU_KERNELS(3)
+ALU_KERNELS(4) ALU_KERNELS(5) ALU_KERNELS(6) ALU_KERNELS(7)
+ALU_KERNELS(8) ALU_KERNELS(9) ALU_KERNELS(10) ALU_KERNELS(11)
+ALU_KERNELS(12) ALU_KERNELS(13) ALU_KERNELS(14) ALU_KERNELS(15)
+
+// [mask][ALU_ADD..ALU_SHR]
+static const alu_fn alu_kernels[16][4] = {
+    ALU_KERNEL_ROW(0), ALU_KERNEL_ROW(1), ALU_KERNEL_ROW(2), ALU_KERNEL_ROW(3),
+    ALU_KERNEL_ROW(4), ALU_KERNEL_ROW(5), ALU_KERNEL_ROW(6), ALU_KERNEL_ROW(7),
+    ALU_KERNEL_ROW(8), ALU_KERNEL_ROW(9), ALU_KERNEL_ROW(10), ALU_KERNEL_ROW(11),
+    ALU_KERNEL_ROW(12), ALU_KERNEL_ROW(13), ALU_KERNEL_ROW(14), ALU_KERNEL_ROW(15)
+};
 
 // ====================================
 // Exchange value
 // ------------------------------------
-static void Xch (unsigned char *src1, unsigned char *src2, const mask_type *mask) {
-    int i;
-    for (i = mask->start; i <= mask->end; i++) {
-        unsigned char tmp;
-        tmp = src1[i];
-        src1[i] = src2[i];
-        src2[i] = tmp;
-    }
+static void Xch (uint64_t *src1, uint64_t *src2, const mask_type *mask) {
+    uint64_t tmp = (*src1 ^ *src2) & digit_mask(mask->start, mask->end);
+    *src1 ^= tmp;
+    *src2 ^= tmp;
 }
 
 // ====================================
-// main CPU function
-// executes instructions
+// micro-op table
+// each opcode is decoded once, at init
 // ------------------------------------
-int execute (unsigned short opcode) {
-    // update instruction cycle counter
-    if (cpu.flags & FLG_IDLE)
-        cpu.cycle += 4;
-    else
-        cpu.cycle++;
+struct uop;
+typedef void (*uop_fn)(struct alu *cpu, const struct uop *u);
+struct uop {
+    uop_fn fn;
+    const mask_type *mask;
+    // flag bit mask, key mask, digit or R5 value
+    unsigned short arg;
+    // alu operation : register ids, see ALU_OP/ALU_DST
+    unsigned char srcX, srcY, dst;
+    unsigned char flags;
+    // ALU kernel for mask and flags
+    alu_fn alu;
+    // exchange registers, REG_NONE if none
+    unsigned char xch1, xch2;
+    // alu destination is IO
+    unsigned char io;
+    // run at S0W, see run_early
+    unsigned char early;
+    const char *log;
+};
+static struct uop uops[0x2000];
 
-    // process opcode
-    if (opcode & 0x1000) {
-        // ================================
-        // jump
-        // ================================
-        cpu.flags |= FLG_JUMP;
-        return 0;
+/* rom words are 13 bits, load_dump doesn't check the upper bits */
+static inline const struct uop *uop_get(unsigned opcode)
+{
+    return &uops[opcode & (IRG_NUM - 1)];
+}
+
+// ================================
+// flag operations
+// ================================
+static void op_test_fa (struct alu *cpu, const struct uop *u) {
+    if (cpu->fA & u->arg)
+        cpu->flags &= ~FLG_COND;
+    if (log_flags & LOG_DEBUG)
+        LOG ("FA=%04X ", cpu->fA);
+    if (log_flags & LOG_SHORT)
+        LOG ("COND=%u", (cpu->flags & FLG_COND) != 0);
+}
+
+static void op_set_fa (struct alu *cpu, const struct uop *u) {
+    cpu->fA |= u->arg;
+    if (log_flags & LOG_SHORT)
+        LOG ("FA=%04X", cpu->fA);
+}
+
+static void op_zero_fa (struct alu *cpu, const struct uop *u) {
+    cpu->fA &= ~u->arg;
+    if (log_flags & LOG_SHORT)
+        LOG ("FA=%04X", cpu->fA);
+}
+
+static void op_invert_fa (struct alu *cpu, const struct uop *u) {
+    cpu->fA ^= u->arg;
+    if (log_flags & LOG_SHORT)
+        LOG ("FA=%04X", cpu->fA);
+}
+
+static void op_exch_fab (struct alu *cpu, const struct uop *u) {
+    if ((cpu->fA ^ cpu->fB) & u->arg) {
+        cpu->fA ^= u->arg;
+        cpu->fB ^= u->arg;
     }
-    if (cpu.flags & FLG_JUMP) {
-        // COND is set again after last jump in series
-        cpu.flags &= ~FLG_JUMP;
-        cpu.flags |= FLG_COND;
+    if (log_flags & LOG_SHORT)
+        LOG ("FA=%04X FB=%04X", cpu->fA, cpu->fB);
+}
+
+static void op_set_kr (struct alu *cpu, const struct uop *u) {
+    cpu->KR |= u->arg;
+    if (log_flags & LOG_SHORT)
+        LOG ("KR=%04X", cpu->KR);
+}
+
+static void op_copy_fba (struct alu *cpu, const struct uop *u) {
+    if ((cpu->fA ^ cpu->fB) & u->arg)
+        cpu->fA ^= u->arg;
+    if (log_flags & LOG_SHORT)
+        LOG ("FA=%04X", cpu->fA);
+}
+
+static void op_r5_fa (struct alu *cpu, const struct uop *u) {
+    cpu->fA = (cpu->fA & ~0x001E) | ((cpu->R5 & 0x000F) << 1);
+    if (log_flags & LOG_SHORT)
+        LOG ("FA=%04X", cpu->fA);
+}
+
+static void op_test_fb (struct alu *cpu, const struct uop *u) {
+    if (cpu->fB & u->arg)
+        cpu->flags &= ~FLG_COND;
+    if (log_flags & LOG_DEBUG)
+        LOG ("FB=%04X ", cpu->fB);
+    if (log_flags & LOG_SHORT)
+        LOG ("COND=%u", (cpu->flags & FLG_COND) != 0);
+}
+
+static void op_set_fb (struct alu *cpu, const struct uop *u) {
+    cpu->fB |= u->arg;
+    if (log_flags & LOG_SHORT)
+        LOG ("FB=%04X", cpu->fB);
+}
+
+static void op_zero_fb (struct alu *cpu, const struct uop *u) {
+    cpu->fB &= ~u->arg;
+    if (log_flags & LOG_SHORT)
+        LOG ("FB=%04X", cpu->fB);
+}
+
+static void op_invert_fb (struct alu *cpu, const struct uop *u) {
+    cpu->fB ^= u->arg;
+    if (log_flags & LOG_SHORT)
+        LOG ("FB=%04X", cpu->fB);
+}
+
+static void op_compare_fab (struct alu *cpu, const struct uop *u) {
+    if (!((cpu->fA ^ cpu->fB) & u->arg))
+        cpu->flags &= ~FLG_COND;
+    if (log_flags & LOG_DEBUG)
+        LOG ("FA=%04X FB=%04X ", cpu->fA, cpu->fB);
+    if (log_flags & LOG_SHORT)
+        LOG ("COND=%u", (cpu->flags & FLG_COND) != 0);
+}
+
+static void op_zero_kr (struct alu *cpu, const struct uop *u) {
+    cpu->KR &= ~u->arg;
+    if (log_flags & LOG_SHORT)
+        LOG ("KR=%04X", cpu->KR);
+}
+
+static void op_copy_fab (struct alu *cpu, const struct uop *u) {
+    if ((cpu->fA ^ cpu->fB) & u->arg)
+        cpu->fB ^= u->arg;
+    if (log_flags & LOG_SHORT)
+        LOG ("FB=%04X", cpu->fB);
+}
+
+static void op_r5_fb (struct alu *cpu, const struct uop *u) {
+    cpu->fB = (cpu->fB & ~0x001E) | ((cpu->R5 & 0x000F) << 1);
+    if (log_flags & LOG_SHORT)
+        LOG ("FB=%04X", cpu->fB);
+}
+
+static const uop_fn flag_ops[16] = {
+    op_test_fa, op_set_fa, op_zero_fa, op_invert_fa,
+    op_exch_fab, op_set_kr, op_copy_fba, op_r5_fa,
+    op_test_fb, op_set_fb, op_zero_fb, op_invert_fb,
+    op_compare_fab, op_zero_kr, op_copy_fab, op_r5_fb
+};
+
+// ================================
+// keyboard operations
+// ================================
+//XXX the rom sometimes doesn't reset COND
+//before key operations...
+//it cause false detection, but there are removed
+//by debouncing. Bug or way to save one instruction
+
+// scan all keyboard
+static void op_key_scan (struct alu *cpu, const struct uop *u) {
+    // get pressed key(s) mask
+    unsigned char mask = u->arg & cpu->key;
+    if (log_flags & LOG_DEBUG)
+        LOG ("(k%d=%02X)", cpu->digit, cpu->key & mask);
+    // check if more than 1 key is pressed
+    if (mask & (mask - 1))
+        mask = 0;
+    // scan current row
+    if (cpu->key & mask) {
+        unsigned char bit = 0;
+        if (log_flags & LOG_DEBUG)
+            LOG ("(K%d=%02X)", cpu->digit, cpu->key & mask);
+        // get bit position
+        while (!(mask & 1)) {
+            bit++;
+            mask >>= 1;
+        }
+        // clear COND
+        cpu->flags &= ~FLG_COND;
+        // set result to KR
+        cpu->KR = /*(cpu->KR & ~0x07F0) |*/ (cpu->digit << 4) | ((bit << 8) & 0x0700);
+        if (log_flags & LOG_SHORT)
+            LOG ("KR=%04X COND=0", cpu->KR);
+    } else
+        if (cpu->digit != 15) {
+            // wait for digit 15 counter - end of scan
+            // SR60 scan from D14 to D15
+            cpu->flags |= FLG_HOLD;
+        }
+}
+
+// scan current row and update COND
+static void op_key_test (struct alu *cpu, const struct uop *u) {
+    unsigned char mask = u->arg & cpu->key;
+    if (log_flags & LOG_DEBUG)
+        LOG ("(k%d=%02X)", cpu->digit, cpu->key & mask);
+    // check if more than 1 key is pressed
+    if (mask & (mask - 1))
+        mask = 0;
+    if (cpu->key & mask)
+        cpu->flags &= ~FLG_COND;
+    if (log_flags & LOG_DEBUG)
+        LOG ("(K%d=%02X) ", cpu->digit, cpu->key & mask);
+    if (log_flags & LOG_SHORT)
+        LOG ("COND=%u", (cpu->flags & FLG_COND) != 0);
+}
+
+// ================================
+// wait operations
+// ================================
+static void op_wait_digit (struct alu *cpu, const struct uop *u) {
+    if (cpu->digit != u->arg) {
+        cpu->flags |= FLG_HOLD;
+        return;
+    }
+    if (log_flags & LOG_DEBUG)
+        LOG ("(D=%u)", cpu->digit);
+}
+
+static void op_zero_idle (struct alu *cpu, const struct uop *u) {
+    cpu->flags &= ~FLG_IDLE;
+    if (log_flags & LOG_SHORT)
+        LOG ("IDLE=0");
+}
+
+static void op_clfa (struct alu *cpu, const struct uop *u) {
+    cpu->fA = 0;
+    if (log_flags & LOG_SHORT)
+        LOG ("FA=%04X", cpu->fA);
+}
+
+static void op_wait_busy (struct alu *cpu, const struct uop *u) {
+#warning "Unknown behaviour..."
+}
+
+// NO-OP + peripherals, Register
+static void op_nop (struct alu *cpu, const struct uop *u) {
+}
+
+static void op_inckr (struct alu *cpu, const struct uop *u) {
+    cpu->KR += 0x0010;
+    if (!(cpu->KR & 0xFFF0))
+        cpu->KR ^= 0x0001;
+    if (log_flags & LOG_SHORT)
+        LOG ("KR=%04X", cpu->KR);
+}
+
+static void op_tkr (struct alu *cpu, const struct uop *u) {
+    if (cpu->KR & u->arg)
+        cpu->flags &= ~FLG_COND;
+    if (log_flags & LOG_DEBUG)
+        LOG ("KR=%04X ", cpu->KR);
+    if (log_flags & LOG_SHORT)
+        LOG ("COND=%u", (cpu->flags & FLG_COND) != 0);
+}
+
+static void op_fbr5 (struct alu *cpu, const struct uop *u) {
+    cpu->R5 = (cpu->fB >> 1) & 0x000F;
+    if (log_flags & LOG_DEBUG)
+        LOG ("FB=%04X ", cpu->fB);
+    if (log_flags & LOG_SHORT)
+        LOG ("R5=%01X", cpu->R5);
+}
+
+static void op_far5 (struct alu *cpu, const struct uop *u) {
+    cpu->R5 = (cpu->fA >> 1) & 0x000F;
+    if (log_flags & LOG_DEBUG)
+        LOG ("FA=%04X ", cpu->fA);
+    if (log_flags & LOG_SHORT)
+        LOG ("R5=%01X", cpu->R5);
+}
+
+// Number
+static void op_number (struct alu *cpu, const struct uop *u) {
+    cpu->R5 = u->arg;
+    if (log_flags & LOG_SHORT)
+        LOG ("R5=%01X", cpu->R5);
+}
+
+static void op_krr5 (struct alu *cpu, const struct uop *u) {
+    cpu->R5 = (cpu->KR >> 4) & 0x000F;
+    if (log_flags & LOG_SHORT)
+        LOG ("R5=%01X", cpu->R5);
+}
+
+static void op_r5kr (struct alu *cpu, const struct uop *u) {
+    cpu->KR = (cpu->KR & ~0x00F0) | (cpu->R5 << 4);
+    if (log_flags & LOG_SHORT)
+        LOG ("KR=%04X", cpu->KR);
+}
+
+static void op_set_idle (struct alu *cpu, const struct uop *u) {
+    cpu->flags |= FLG_IDLE;
+    if (log_flags & LOG_SHORT)
+        LOG ("IDLE=1");
+}
+
+static void op_clfb (struct alu *cpu, const struct uop *u) {
+    cpu->fB = 0;
+    if (log_flags & LOG_SHORT)
+        LOG ("FB=%04X", cpu->fB);
+}
+
+static void op_test_busy (struct alu *cpu, const struct uop *u) {
+    if ((cpu->key & (1 << KR_BIT)) || (cpu->flags & FLG_BUSY))
+        cpu->flags &= ~(FLG_COND | FLG_BUSY);
+    if (log_flags & LOG_SHORT)
+        LOG ("(K%d=%02X) COND=%u", cpu->digit, cpu->key & (1 << KR_BIT), (cpu->flags & FLG_COND) != 0);
+}
+
+static void op_extkr (struct alu *cpu, const struct uop *u) {
+    // XXX KR[0] set ????
+    //cpu->KR = (cpu->KR & 0x000F) | ((cpu->EXT << 1) & 0xFFF0);
+    cpu->KR = ((cpu->EXT << 1) & 0xFFF0) | (cpu->EXT >> 15);
+    if (log_flags & LOG_SHORT)
+        LOG ("KR=%04X", cpu->KR);
+}
+
+static void op_xkrsr (struct alu *cpu, const struct uop *u) {
+    unsigned short tmp;
+    tmp = cpu->KR;
+    cpu->KR = cpu->SR;
+    cpu->SR = tmp;
+    if (log_flags & LOG_SHORT)
+        LOG ("KR=%04X SR=%04X", cpu->KR, cpu->SR);
+}
+
+// ================================
+// ALU operations
+// ================================
+static const struct {
+    unsigned char srcX, srcY;
+    unsigned char flags;
+} ALU_OP[32] = {
+    {REG_A, REG_NONE, ALU_ADD},
+    {REG_A, REG_NONE, ALU_SUB},
+    {REG_NONE, REG_B, ALU_ADD},
+    {REG_NONE, REG_B, ALU_SUB},
+    {REG_C, REG_NONE, ALU_ADD},
+    {REG_C, REG_NONE, ALU_SUB},
+    {REG_NONE, REG_D, ALU_ADD},
+    {REG_NONE, REG_D, ALU_SUB},
+    {REG_A, REG_NONE, ALU_SHL},
+    {REG_A, REG_NONE, ALU_SHR},
+    {REG_NONE, REG_B, ALU_SHL},
+    {REG_NONE, REG_B, ALU_SHR},
+    {REG_C, REG_NONE, ALU_SHL},
+    {REG_C, REG_NONE, ALU_SHR},
+    {REG_NONE, REG_D, ALU_SHL},
+    {REG_NONE, REG_D, ALU_SHR},
+    {REG_A, REG_B, ALU_ADD},
+    {REG_A, REG_B, ALU_SUB},
+    {REG_C, REG_B, ALU_ADD},
+    {REG_C, REG_B, ALU_SUB},
+    {REG_C, REG_D, ALU_ADD},
+    {REG_C, REG_D, ALU_SUB},
+    {REG_A, REG_D, ALU_ADD},
+    {REG_A, REG_D, ALU_SUB},
+    // following needs special approach...
+    // -> variable pointers, RAM/SCOM access, R5 access
+    {REG_A, REG_NONE /*CONSTANT[((cpu->KR >> 5) & 0x78) | ((cpu->KR >> 4) & 0x07)]*/, ALU_ADD}, // IO read
+    {REG_A, REG_NONE /*CONSTANT[((cpu->KR >> 5) & 0x78) | ((cpu->KR >> 4) & 0x07)]*/, ALU_SUB}, // IO read
+    {REG_NONE, REG_NONE, ALU_ADD}, // IO read: 0 -> SCOM[cpu->REG_ADDR] | RAM[cpu->RAM_ADDR]
+    {REG_NONE, REG_NONE, ALU_SUB},
+    {REG_C, REG_NONE /*CONSTANT[((cpu->KR >> 5) & 0x78) | ((cpu->KR >> 4) & 0x07)]*/, ALU_ADD}, // IO read
+    {REG_C, REG_NONE /*CONSTANT[((cpu->KR >> 5) & 0x78) | ((cpu->KR >> 4) & 0x07)]*/, ALU_SUB}, // IO read
+    {REG_NONE, REG_NONE /*cpu->R5*/, ALU_ADD}, // IO read ??
+    {REG_NONE, REG_NONE /*cpu->R5*/, ALU_SUB} // IO read ??
+};
+static const struct {
+    unsigned char dst;
+    unsigned char xch1, xch2;
+    char log[4];
+} ALU_DST[8] = {
+    {REG_A, REG_NONE, REG_NONE, "A"},
+    {REG_NONE, REG_NONE, REG_NONE, "IO"},
+    {REG_NONE, REG_A, REG_B, ""}, // Xch A,B
+    {REG_B, REG_NONE, REG_NONE, "B"},
+    {REG_C, REG_NONE, REG_NONE, "C"},
+    {REG_NONE, REG_C, REG_D, ""}, // Xch C,D
+    {REG_D, REG_NONE, REG_NONE, "D"},
+    {REG_NONE, REG_A, REG_E, ""}  // Xch A,E
+};
+static const char reg_name[6] = " ABCDE";
+
+// EXCHANGE instructions
+static inline void alu_xch (struct alu *cpu, const struct uop *u) {
+    if (u->xch1 == REG_NONE)
+        return;
+    Xch (cpu->reg[u->xch1], cpu->reg[u->xch2], u->mask);
+    if (log_flags & LOG_SHORT)
+        LOG ("%c=%016llX %c=%016llX", reg_name[u->xch1], (unsigned long long)*cpu->reg[u->xch1],
+                reg_name[u->xch2], (unsigned long long)*cpu->reg[u->xch2]);
+}
+
+static inline void alu_log (struct alu *cpu, const struct uop *u) {
+    uint64_t *dst = cpu->reg[u->dst];
+    if (*u->log && (log_flags & LOG_SHORT))
+        LOG ("%s=%016llX", u->log, (unsigned long long)(dst ? *dst : cpu->Sout));
+}
+
+// generic ALU operation
+static void op_alu (struct alu *cpu, const struct uop *u) {
+    if (u->io)
+        cpu->flags |= FLG_IO_VALID;
+    u->alu (cpu, cpu->reg[u->dst], cpu->reg[u->srcX], cpu->reg[u->srcY]);
+    alu_xch (cpu, u);
+    alu_log (cpu, u);
+}
+
+// R5->Adder
+// 0x00F8 not used in TI-58, probably different behavior...
+static void op_alu_r5 (struct alu *cpu, const struct uop *u) {
+    const mask_type *mask = u->mask;
+    uint64_t *dst = cpu->reg[u->dst];
+    if (u->io)
+        cpu->flags |= FLG_IO_VALID;
+    if (dst) {
+        *dst &= ~digit_mask(mask->start+1, mask->end);
+        *dst = (*dst & ~(0xFULL << (4 * mask->cpos))) | ((uint64_t)mask->cval << (4 * mask->cpos));
+        if (mask->start <= 15)
+            *dst = (*dst & ~(0xFULL << (4 * mask->start))) | ((uint64_t)cpu->R5 << (4 * mask->start));
+        // make BCD correction
+        u->alu (cpu, dst, 0, dst);
     }
+    alu_xch (cpu, u);
+    alu_log (cpu, u);
+}
+
+// instruction that must run at S0W
+static int run_early(int opcode)
+{
+    switch (opcode & 0x1F00) {
+        case 0x0000: /* flags */
+            return 1;
+        case 0x0800: /* keyboard */
+            return 1; /* HOLD/COND */
+        case 0x0A00: /* wait */
+            switch (opcode & 0xF) {
+                case 0x0: /* wait digit */
+                    return 1; /* HOLD */
+                case 0x3: /* wait busy */
+                case 0xB: /* test busy. log cpu->digit */
+                    return 1; /* COND */
+                case 0xC: /* mov KR, EXT */
+                    return 0; /* need EXT, to check XXX */
+                default:
+                    return 1;
+            }
+        default: /* alu */
+            if ((opcode & 7) == 1) /* IO write. Can set R5/COND */
+                return 1;
+    }
+    return 0;
+}
+
+static uop_fn decode_wait(unsigned short opcode)
+{
+    static const uop_fn wait_ops[16] = {
+        op_wait_digit, op_zero_idle, op_clfa, op_wait_busy,
+        op_inckr, op_tkr, op_nop, op_number,
+        op_nop, op_set_idle, op_clfb, op_test_busy,
+        op_extkr, op_xkrsr, op_nop, op_nop
+    };
+
+    switch (opcode & 0x000F) {
+        case 0x0006:
+            // FLGR5 + peripherals
+            switch (opcode & 0x00F0) {
+                case 0x0010:
+                    return op_fbr5;
+                case 0x0000:
+                    return op_far5;
+            }
+            return op_nop;
+        case 0x0008:
+            // KRR5/R5KR + peripherals
+            switch (opcode & 0x00F0) {
+                case 0x0000:
+                    return op_krr5;
+                case 0x0010:
+                    return op_r5kr;
+            }
+            return op_nop;
+    }
+    return wait_ops[opcode & 0x000F];
+}
+
+static void decode(struct uop *u, unsigned short opcode)
+{
+    memset(u, 0, sizeof(*u));
+    u->early = run_early(opcode);
+    u->log = "";
     switch (opcode & 0x0F00) {
-        // ================================
-        // flag operations
-        // ================================
         case 0x0000:
-            {
-                unsigned bit = (opcode >> 4) & 0x000F;
-                unsigned mask = 1 << bit;
-                switch (opcode & 0x000F) {
-                    case 0x0000:
-                        // TEST FLAG A
-                        if (cpu.fA & mask)
-                            cpu.flags &= ~FLG_COND;
-                        if (log_flags & LOG_DEBUG)
-                            LOG ("FA=%04X ", cpu.fA);
-                        if (log_flags & LOG_SHORT)
-                            LOG ("COND=%u", (cpu.flags & FLG_COND) != 0);
-                        break;
-                    case 0x0001:
-                        // SET FLAG A
-                        cpu.fA |= mask;
-                        if (log_flags & LOG_SHORT)
-                            LOG ("FA=%04X", cpu.fA);
-                        break;
-                    case 0x0002:
-                        // ZERO FLAG A
-                        cpu.fA &= ~mask;
-                        if (log_flags & LOG_SHORT)
-                            LOG ("FA=%04X", cpu.fA);
-                        break;
-                    case 0x0003:
-                        // INVERT FLAG A
-                        cpu.fA ^= mask;
-                        if (log_flags & LOG_SHORT)
-                            LOG ("FA=%04X", cpu.fA);
-                        break;
-                    case 0x0004:
-                        // EXCH. FLAG A B
-                        if ((cpu.fA ^ cpu.fB) & mask) {
-                            cpu.fA ^= mask;
-                            cpu.fB ^= mask;
-                        }
-                        if (log_flags & LOG_SHORT)
-                            LOG ("FA=%04X FB=%04X", cpu.fA, cpu.fB);
-                        break;
-                    case 0x0005:
-                        // SET FLAG KR
-                        cpu.KR |= mask;
-                        if (log_flags & LOG_SHORT)
-                            LOG ("KR=%04X", cpu.KR);
-                        break;
-                    case 0x0006:
-                        // COPY FLAG B->A
-                        if ((cpu.fA ^ cpu.fB) & mask)
-                            cpu.fA ^= mask;
-                        if (log_flags & LOG_SHORT)
-                            LOG ("FA=%04X", cpu.fA);
-                        break;
-                    case 0x0007:
-                        // REG 5->FLAG A S0 S3
-                        cpu.fA = (cpu.fA & ~0x001E) | ((cpu.R5 & 0x000F) << 1);
-                        if (log_flags & LOG_SHORT)
-                            LOG ("FA=%04X", cpu.fA);
-                        break;
-                    case 0x0008:
-                        // TEST FLAG B
-                        if (cpu.fB & mask)
-                            cpu.flags &= ~FLG_COND;
-                        if (log_flags & LOG_DEBUG)
-                            LOG ("FB=%04X ", cpu.fB);
-                        if (log_flags & LOG_SHORT)
-                            LOG ("COND=%u", (cpu.flags & FLG_COND) != 0);
-                        break;
-                    case 0x0009:
-                        // SET FLAG B
-                        cpu.fB |= mask;
-                        if (log_flags & LOG_SHORT)
-                            LOG ("FB=%04X", cpu.fB);
-                        break;
-                    case 0x000A:
-                        // ZERO FLAG B
-                        cpu.fB &= ~mask;
-                        if (log_flags & LOG_SHORT)
-                            LOG ("FB=%04X", cpu.fB);
-                        break;
-                    case 0x000B:
-                        // INVERT FLAG B
-                        cpu.fB ^= mask;
-                        if (log_flags & LOG_SHORT)
-                            LOG ("FB=%04X", cpu.fB);
-                        break;
-                    case 0x000C:
-                        // COMPARE FLAG A B
-                        if (!((cpu.fA ^ cpu.fB) & mask))
-                            cpu.flags &= ~FLG_COND;
-                        if (log_flags & LOG_DEBUG)
-                            LOG ("FA=%04X FB=%04X ", cpu.fA, cpu.fB);
-                        if (log_flags & LOG_SHORT)
-                            LOG ("COND=%u", (cpu.flags & FLG_COND) != 0);
-                        break;
-                    case 0x000D:
-                        // ZERO FLAG KR
-                        cpu.KR &= ~mask;
-                        if (log_flags & LOG_SHORT)
-                            LOG ("KR=%04X", cpu.KR);
-                        break;
-                    case 0x000E:
-                        // COPY FLAG A->B
-                        if ((cpu.fA ^ cpu.fB) & mask)
-                            cpu.fB ^= mask;
-                        if (log_flags & LOG_SHORT)
-                            LOG ("FB=%04X", cpu.fB);
-                        break;
-                    case 0x000F:
-                        // REG 5->FLAG B S0 S3
-                        cpu.fB = (cpu.fB & ~0x001E) | ((cpu.R5 & 0x000F) << 1);
-                        if (log_flags & LOG_SHORT)
-                            LOG ("FB=%04X", cpu.fB);
-                        break;
-                }
-            }
+            u->fn = flag_ops[opcode & 0x000F];
+            u->arg = 1 << ((opcode >> 4) & 0x000F);
             break;
-            // ================================
-            // keyboard operations
-            // ================================
         case 0x0800:
-            {
-                //XXX the rom sometimes doesn't reset COND
-                //before key operations...
-                //it cause false detection, but there are removed
-                //by debouncing. Bug or way to save one instruction
-                unsigned char mask;
-                // get pressed key(s) mask
-                mask = (((opcode & 0x07) | ((opcode >> 1) & 0x78)) ^ 0x7F) & cpu.key;
-                if (log_flags & LOG_DEBUG)
-                    LOG ("(k%d=%02X)", cpu.digit, cpu.key & mask);
-                // check if more than 1 key is pressed
-                if (mask & (mask - 1))
-                    mask = 0;
-                if (!(opcode & 0x0008)) {
-                    // scan all keyboard
-                    // scan current row
-                    if (cpu.key & mask) {
-                        unsigned char bit = 0;
-                        if (log_flags & LOG_DEBUG)
-                            LOG ("(K%d=%02X)", cpu.digit, cpu.key & mask);
-                        // get bit position
-                        while (!(mask & 1)) {
-                            bit++;
-                            mask >>= 1;
-                        }
-                        // clear COND
-                        cpu.flags &= ~FLG_COND;
-                        // set result to KR
-                        cpu.KR = /*(cpu.KR & ~0x07F0) |*/ (cpu.digit << 4) | ((bit << 8) & 0x0700);
-                        if (log_flags & LOG_SHORT)
-                            LOG ("KR=%04X COND=0", cpu.KR);
-                    } else
-                        if (cpu.digit != 15) {
-                            // wait for digit 15 counter - end of scan
-                            // SR60 scan from D14 to D15
-                            cpu.flags |= FLG_HOLD;
-                            return 11;
-                        }
-                } else {
-                    // scan current row and update COND
-                    if (cpu.key & mask)
-                        cpu.flags &= ~FLG_COND;
-                    if (log_flags & LOG_DEBUG)
-                        LOG ("(K%d=%02X) ", cpu.digit, cpu.key & mask);
-                    if (log_flags & LOG_SHORT)
-                        LOG ("COND=%u", (cpu.flags & FLG_COND) != 0);
-                }
-            }
+            u->fn = (opcode & 0x0008) ? op_key_test : op_key_scan;
+            u->arg = ((opcode & 0x07) | ((opcode >> 1) & 0x78)) ^ 0x7F;
             break;
-            // ================================
-            // wait operations
-            // ================================
         case 0x0A00:
-            switch (opcode & 0x000F) {
-                case 0x0000:
-                    // wait for digit
-                    if (cpu.digit != ((opcode >> 4) & 0x000F)) {
-                        cpu.flags |= FLG_HOLD;
-                        return 12;
-                    }
-                    if (log_flags & LOG_DEBUG)
-                        LOG ("(D=%u)", cpu.digit);
-                    break;
-                case 0x0001:
-                    // Zero Idle
-                    cpu.flags &= ~FLG_IDLE;
-                    if (log_flags & LOG_SHORT)
-                        LOG ("IDLE=0");
-                    break;
-                case 0x0002:
-                    // CLFA
-                    cpu.fA = 0;
-                    if (log_flags & LOG_SHORT)
-                        LOG ("FA=%04X", cpu.fA);
-                    break;
-                case 0x0003:
-                    // Wait Busy
-#warning "Unknown behaviour..."
-                    break;
-                case 0x0004:
-                    // INCKR
-                    cpu.KR += 0x0010;
-                    if (!(cpu.KR & 0xFFF0))
-                        cpu.KR ^= 0x0001;
-                    if (log_flags & LOG_SHORT)
-                        LOG ("KR=%04X", cpu.KR);
-                    break;
-                case 0x0005:
-                    // TKR
-                    if (cpu.KR & (1 << ((opcode >> 4) & 0x000F)))
-                        cpu.flags &= ~FLG_COND;
-                    if (log_flags & LOG_DEBUG)
-                        LOG ("KR=%04X ", cpu.KR);
-                    if (log_flags & LOG_SHORT)
-                        LOG ("COND=%u", (cpu.flags & FLG_COND) != 0);
-                    break;
-                case 0x0006:
-                    // FLGR5 + peripherals
-                    switch (opcode & 0x00F0) {
-                      case 0x0010:
-                        cpu.R5 = (cpu.fB >> 1) & 0x000F;
-                        if (log_flags & LOG_DEBUG)
-                            LOG ("FB=%04X ", cpu.fB);
-                        if (log_flags & LOG_SHORT)
-                            LOG ("R5=%01X", cpu.R5);
-                        break;
-                      case 0x0000:
-                        cpu.R5 = (cpu.fA >> 1) & 0x000F;
-                        if (log_flags & LOG_DEBUG)
-                            LOG ("FA=%04X ", cpu.fA);
-                        if (log_flags & LOG_SHORT)
-                            LOG ("R5=%01X", cpu.R5);
-                        break;
-                    }
-                    break;
-                case 0x0007:
-                    // Number
-                    cpu.R5 = (opcode >> 4) & 0x000F;
-                    if (log_flags & LOG_SHORT)
-                        LOG ("R5=%01X", cpu.R5);
-                    break;
-                case 0x0008:
-                    // KRR5/R5KR + peripherals
-                    switch (opcode & 0x00F0) {
-                        case 0x0000:
-                            // KRR5
-                            cpu.R5 = (cpu.KR >> 4) & 0x000F;
-                            if (log_flags & LOG_SHORT)
-                                LOG ("R5=%01X", cpu.R5);
-                            break;
-                        case 0x0010:
-                            // R5KR
-                            cpu.KR = (cpu.KR & ~0x00F0) | (cpu.R5 << 4);
-                            if (log_flags & LOG_SHORT)
-                                LOG ("KR=%04X", cpu.KR);
-                            break;
-                    }
-                    break;
-                case 0x0009:
-                    // Set Idle
-                    cpu.flags |= FLG_IDLE;
-                    if (log_flags & LOG_SHORT)
-                        LOG ("IDLE=1");
-                    break;
-                case 0x000A:
-                    // CLFB
-                    cpu.fB = 0;
-                    if (log_flags & LOG_SHORT)
-                        LOG ("FB=%04X", cpu.fB);
-                    break;
-                case 0x000B:
-                    // Test Busy
-                    if ((cpu.key & (1 << KR_BIT)) || (cpu.flags & FLG_BUSY))
-                        cpu.flags &= ~(FLG_COND | FLG_BUSY);
-                    if (log_flags & LOG_SHORT)
-                        LOG ("(K%d=%02X) COND=%u", cpu.digit, cpu.key & (1 << KR_BIT), (cpu.flags & FLG_COND) != 0);
-                    break;
-                case 0x000C:
-                    // EXTKR
-                    // XXX KR[0] set ????
-                    //cpu.KR = (cpu.KR & 0x000F) | ((cpu.EXT << 1) & 0xFFF0);
-                    cpu.KR = ((cpu.EXT << 1) & 0xFFF0) | (cpu.EXT >> 15);
-                    if (log_flags & LOG_SHORT)
-                        LOG ("KR=%04X", cpu.KR);
-                    break;
-                case 0x000D:
-                    // XKRSR
-                    {
-                        unsigned short tmp;
-                        tmp = cpu.KR;
-                        cpu.KR = cpu.SR;
-                        cpu.SR = tmp;
-                    }
-                    if (log_flags & LOG_SHORT)
-                        LOG ("KR=%04X SR=%04X", cpu.KR, cpu.SR);
-                    break;
-                case 0x000E:
-                    // NO-OP + peripherals
-                    switch (opcode & 0x00F0) {
-                        break;
-                    }
+            u->fn = decode_wait(opcode);
+            u->arg = (opcode >> 4) & 0x000F;
+            if ((opcode & 0x000F) == 0x0005)
+                u->arg = 1 << u->arg;
+            break;
+        default:
+            u->mask = &mask_info[(opcode >> 8) & 0x0F];
+            u->srcX = ALU_OP[(opcode >> 3) & 0x1F].srcX;
+            u->srcY = ALU_OP[(opcode >> 3) & 0x1F].srcY;
+            u->flags = ALU_OP[(opcode >> 3) & 0x1F].flags;
+            u->dst = ALU_DST[opcode & 0x07].dst;
+            u->xch1 = ALU_DST[opcode & 0x07].xch1;
+            u->xch2 = ALU_DST[opcode & 0x07].xch2;
+            u->log = ALU_DST[opcode & 0x07].log;
+            u->io = (opcode & 0x07) == 0x01;
+            switch (opcode & 0x00F8) {
+                default:
+                    u->fn = op_alu;
                     break;
-                case 0x000F:
-                    // Register
-                    switch (opcode & 0x00F0) {
-                        break;
-                    }
+                case 0x00F0: // R5->Adder
+                case 0x00F8:
+                    u->fn = op_alu_r5;
+                    u->flags = (opcode & 0x0008) ? ALU_SUB : ALU_ADD; // not sure with SUB...
                     break;
             }
+            u->alu = alu_kernels[(opcode >> 8) & 0x0F][u->flags];
             break;
-            // ================================
-            // ALU operations
-            // ================================
-        default: 
-            {
-                const mask_type *mask = &mask_info[(opcode >> 8) & 0x0F];
-                static const struct {
-                    unsigned char *srcX, *srcY;
-                    unsigned char flags;
-                } *alu_inp, ALU_OP[32] = {
-                    {cpu.A, 0, ALU_ADD},
-                    {cpu.A, 0, ALU_SUB},
-                    {0, cpu.B, ALU_ADD},
-                    {0, cpu.B, ALU_SUB},
-                    {cpu.C, 0, ALU_ADD},
-                    {cpu.C, 0, ALU_SUB},
-                    {0, cpu.D, ALU_ADD},
-                    {0, cpu.D, ALU_SUB},
-                    {cpu.A, 0, ALU_SHL},
-                    {cpu.A, 0, ALU_SHR},
-                    {0, cpu.B, ALU_SHL},
-                    {0, cpu.B, ALU_SHR},
-                    {cpu.C, 0, ALU_SHL},
-                    {cpu.C, 0, ALU_SHR},
-                    {0, cpu.D, ALU_SHL},
-                    {0, cpu.D, ALU_SHR},
-                    {cpu.A, cpu.B, ALU_ADD},
-                    {cpu.A, cpu.B, ALU_SUB},
-                    {cpu.C, cpu.B, ALU_ADD},
-                    {cpu.C, cpu.B, ALU_SUB},
-                    {cpu.C, cpu.D, ALU_ADD},
-                    {cpu.C, cpu.D, ALU_SUB},
-                    {cpu.A, cpu.D, ALU_ADD},
-                    {cpu.A, cpu.D, ALU_SUB},
-                    // following needs special approach...
-                    // -> variable pointers, RAM/SCOM access, R5 access
-                    {cpu.A, 0 /*CONSTANT[((cpu.KR >> 5) & 0x78) | ((cpu.KR >> 4) & 0x07)]*/, ALU_ADD}, // IO read
-                    {cpu.A, 0 /*CONSTANT[((cpu.KR >> 5) & 0x78) | ((cpu.KR >> 4) & 0x07)]*/, ALU_SUB}, // IO read
-                    {0, 0, ALU_ADD}, // IO read: 0 -> SCOM[cpu.REG_ADDR] | RAM[cpu.RAM_ADDR]
-                    {0, 0, ALU_SUB},
-                    {cpu.C, 0 /*CONSTANT[((cpu.KR >> 5) & 0x78) | ((cpu.KR >> 4) & 0x07)]*/, ALU_ADD}, // IO read
-                    {cpu.C, 0 /*CONSTANT[((cpu.KR >> 5) & 0x78) | ((cpu.KR >> 4) & 0x07)]*/, ALU_SUB}, // IO read
-                    {0, 0 /*cpu.R5*/, ALU_ADD}, // IO read ??
-                    {0, 0 /*cpu.R5*/, ALU_SUB} // IO read ??
-                };
-                static const struct {
-                    unsigned char *dst;
-                    char log[4];
-                } *alu_out, ALU_DST[8] = {
-                    {cpu.A, "A"},
-                    {0, "IO"},
-                    {0, ""}, // Xch A,B
-                    {cpu.B, "B"},
-                    {cpu.C, "C"},
-                    {0, ""}, // Xch C,D
-                    {cpu.D, "D"},
-                    {0, ""}  // Xch A,E
-                };
-                alu_out = &ALU_DST[opcode & 0x07];
-                if ((opcode & 0x07) == 0x01)
-                    cpu.flags |= FLG_IO_VALID;
-                alu_inp = &ALU_OP[(opcode >> 3) & 0x1F];
-                switch (opcode & 0x00F8) {
-                    default:
-                        // generic ALU operation
-                        Alu (alu_out->dst, alu_inp->srcX, alu_inp->srcY, mask, alu_inp->flags);
-                        break;
-                        // process special cases
-                    case 0x00F0: // R5->Adder
-                    case 0x00F8: // not used in TI-58, probably different behavior...
-                        if (alu_out->dst) {
-                            int i;
-                            for (i = mask->start+1; i <= mask->end; i++)
-                                alu_out->dst[i] = 0;
-                            alu_out->dst[mask->cpos] = mask->cval;
-                            alu_out->dst[mask->start] = cpu.R5;
-                            // make BCD correction
-                            if (!(opcode & 0x0008))
-                                Alu (alu_out->dst, 0, alu_out->dst, mask, ALU_ADD);
-                            else
-                                Alu (alu_out->dst, 0, alu_out->dst, mask, ALU_SUB); // not sure with this...
-                        }
-                        break;
-                }
-                // EXCHANGE instructions
-                switch (opcode & 0x0007) {
-                    case 0x0002: // A<->B
-                        Xch (cpu.A, cpu.B, mask);
-                        if (log_flags & LOG_SHORT) {
-                            int i;
-                            LOG ("A="); for (i = 15; i >= 0; i--) LOG ("%X", cpu.A[i]);
-                            LOG (" B="); for (i = 15; i >= 0; i--) LOG ("%X", cpu.B[i]);
-                        }
-                        break;
-                    case 0x0005: // C<->D
-                        Xch (cpu.C, cpu.D, mask);
-                        if (log_flags & LOG_SHORT) {
-                            int i;
-                            LOG ("C="); for (i = 15; i >= 0; i--) LOG ("%X", cpu.C[i]);
-                            LOG (" D="); for (i = 15; i >= 0; i--) LOG ("%X", cpu.D[i]);
-                        }
-                        break;
-                    case 0x0007: // A<->E
-                        Xch (cpu.A, cpu.E, mask);
-                        if (log_flags & LOG_SHORT) {
-                            int i;
-                            LOG ("A="); for (i = 15; i >= 0; i--) LOG ("%X", cpu.A[i]);
-                            LOG (" E="); for (i = 15; i >= 0; i--) LOG ("%X", cpu.E[i]);
-                        }
-                        break;
-                }
-                if (*alu_out->log && (log_flags & LOG_SHORT)) {
-                    int i;
-                    unsigned char *ptr = alu_out->dst;
-                    if (!ptr)
-                        ptr = cpu.Sout;
-                    LOG ("%s=", alu_out->log); for (i = 15; i >= 0; i--) LOG ("%X", ptr[i]);
-                }
-            }
     }
+}
 
-    return 0;
+static void decode_init(void)
+{
+    static int done;
+
+    if (done)
+        return;
+    for (int i = 0; i < 0x2000; i++)
+        decode(&uops[i], i);
+    done = 1;
+}
+
+// ====================================
+// main CPU function
+// executes instructions
+// ------------------------------------
+static void execute (struct alu *cpu, unsigned short opcode) {
+    const struct uop *u;
+
+    // process opcode
+    if (opcode & 0x1000) {
+        // ================================
+        // jump
+        // ================================
+        cpu->flags |= FLG_JUMP;
+        return;
+    }
+    if (cpu->flags & FLG_JUMP) {
+        // COND is set again after last jump in series
+        cpu->flags &= ~FLG_JUMP;
+        cpu->flags |= FLG_COND;
+    }
+    u = uop_get(opcode);
+    u->fn(cpu, u);
 }
 
 
-static void debug(int addr, int opcode)
+static void debug(struct alu *cpu, int addr, int opcode)
 {
     if (log_flags) {
         DIS("\n");
         if (log_flags & LOG_SHORT)
 #if 1
-            DIS ("%04X:%c%c%c.D%02d\t%04X\t", addr, (cpu.flags & FLG_COND) ? 'C' : '-',
-                    (cpu.flags & FLG_IDLE) ? 'I' : '-',
-                    (cpu.flags & FLG_HOLD) ? 'H' : '-',
-                    cpu.digit,
+            DIS ("%04X:%c%c%c.D%02d\t%04X\t", addr, (cpu->flags & FLG_COND) ? 'C' : '-',
+                    (cpu->flags & FLG_IDLE) ? 'I' : '-',
+                    (cpu->flags & FLG_HOLD) ? 'H' : '-',
+                    cpu->digit,
                     opcode);
 #else
-            DIS ("%04X:%c%c\t%04X\t", addr, (cpu.flags & FLG_COND) ? 'C' : '-',
-                    (cpu.flags & FLG_IDLE) ? 'I' : '-',
+            DIS ("%04X:%c%c\t%04X\t", addr, (cpu->flags & FLG_COND) ? 'C' : '-',
+                    (cpu->flags & FLG_IDLE) ? 'I' : '-',
                     opcode);
 #endif
         else
@@ -668,18 +930,16 @@ static void debug(int addr, int opcode)
         DIS ("\n");
         if (log_flags & LOG_HRAST) {
             int i;
-            LOG_H ("A="); for (i = 15; i >= 0; i--) LOG_H ("%X", cpu.A[i]);
-            LOG_H (" B="); for (i = 15; i >= 0; i--) LOG_H ("%X", cpu.B[i]);
-            LOG_H (" C="); for (i = 15; i >= 0; i--) LOG_H ("%X", cpu.C[i]);
-            LOG_H (" D="); for (i = 15; i >= 0; i--) LOG_H ("%X", cpu.D[i]);
-            LOG_H (" E="); for (i = 15; i >= 0; i--) LOG_H ("%X", cpu.E[i]);
-            LOG_H ("\nFA=%04X [", cpu.fA); for (i = 15; i >= 0; i--) LOG_H ("%d", (cpu.fA >> i) & 1);
-            LOG_H ("] KR=%04X [", cpu.KR); for (i = 15; i >= 0; i--) LOG_H ("%d", (cpu.KR >> i) & 1);
-            LOG_H ("] EXT=%02X COND=%d IDLE=%d", (cpu.EXT >> 4) & 0xFF, (cpu.flags & FLG_COND) != 0, (cpu.flags & FLG_IDLE) != 0);
-            LOG_H (" IOi="); for (i = 15; i >= 0; i--) LOG_H ("%X", cpu.Sin[i]);
-            LOG_H (" IO="); for (i = 15; i >= 0; i--) LOG_H ("%X", cpu.Sout[i]);
-            LOG_H ("\nFB=%04X [", cpu.fB); for (i = 15; i >= 0; i--) LOG_H ("%d", (cpu.fB >> i) & 1);
-            LOG_H ("] SR=%04X R5=%X", cpu.SR, cpu.R5);
+            LOG_H ("A=%016llX B=%016llX C=%016llX D=%016llX E=%016llX",
+                    (unsigned long long)cpu->A, (unsigned long long)cpu->B,
+                    (unsigned long long)cpu->C, (unsigned long long)cpu->D,
+                    (unsigned long long)cpu->E);
+            LOG_H ("\nFA=%04X [", cpu->fA); for (i = 15; i >= 0; i--) LOG_H ("%d", (cpu->fA >> i) & 1);
+            LOG_H ("] KR=%04X [", cpu->KR); for (i = 15; i >= 0; i--) LOG_H ("%d", (cpu->KR >> i) & 1);
+            LOG_H ("] EXT=%02X COND=%d IDLE=%d", (cpu->EXT >> 4) & 0xFF, (cpu->flags & FLG_COND) != 0, (cpu->flags & FLG_IDLE) != 0);
+            LOG_H (" IOi=%016llX IO=%016llX", (unsigned long long)cpu->Sin, (unsigned long long)cpu->Sout);
+            LOG_H ("\nFB=%04X [", cpu->fB); for (i = 15; i >= 0; i--) LOG_H ("%d", (cpu->fB >> i) & 1);
+            LOG_H ("] SR=%04X R5=%X", cpu->SR, cpu->R5);
             LOG_H ("\n");
         } else {
             LOG ("\t");
@@ -688,75 +948,50 @@ static void debug(int addr, int opcode)
 }
 
 
-static inline int run_early(int opcode)
+static void alu_gen_digit(struct alu *cpu, struct bus *bus)
 {
-    switch (opcode & 0x1F00) {
-        case 0x0000: /* flags */
-            return 1;
-        case 0x0800: /* keyboard */
-            return 1; /* HOLD/COND */
-        case 0x0A00: /* wait */
-            switch (opcode & 0xF) {
-                case 0x0: /* wait digit */
-                    return 1; /* HOLD */
-                case 0x3: /* wait busy */
-                case 0xB: /* test busy. log cpu.digit */
-                    return 1; /* COND */
-                case 0xC: /* mov KR, EXT */
-                    return 0; /* need EXT, to check XXX */
-                default:
-                    return 1;
-            }
-        default: /* alu */
-            if ((opcode & 7) == 1) /* IO write. Can set R5/COND */
-                return 1;
-    }
-    return 0;
-}
-
-static void alu_gen_digit(struct bus *bus)
-{
-    if (cpu.flags & FLG_IDLE) {
-        int i = cpu.digit;
+    if (cpu->flags & FLG_IDLE) {
+        int i = cpu->digit;
+        unsigned a = DIGIT(cpu->A, i), b = DIGIT(cpu->B, i);
 #ifndef DISP_DBG
         if (i == 15)
-            cpu.zero_suppr = 1;
+            cpu->zero_suppr = 1;
         if (i == 3 ||
-                (cpu.R5 == i && i != 15) ||
-                cpu.B[i] >= 8)
-            cpu.zero_suppr = 0;
+                (cpu->R5 == i && i != 15) ||
+                b >= 8)
+            cpu->zero_suppr = 0;
         if (i == 2)
-            cpu.zero_suppr = 1;
-        if (cpu.B[i] == 7 || cpu.B[i] == 3 || (cpu.B[i] <= 4 && cpu.zero_suppr && !cpu.A[i]))
+            cpu->zero_suppr = 1;
+        if (b == 7 || b == 3 || (b <= 4 && cpu->zero_suppr && !a))
             bus->display_digit = ' ';
-        else if (cpu.B[i] == 6 || (cpu.B[i] == 5 && !cpu.A[i]))
+        else if (b == 6 || (b == 5 && !a))
             bus->display_digit = '-';
-        else if (cpu.B[i] == 5)
+        else if (b == 5)
             bus->display_digit = 'o';
-        else if (cpu.B[i] == 4)
+        else if (b == 4)
             bus->display_digit = '\'';
         //XXX B[3] or B[i] ?
-        else if (cpu.B[3] == 2)
+        else if (DIGIT(cpu->B, 3) == 2)
             bus->display_digit = '"';
         else {
-            bus->display_digit = '0' + cpu.A[i];
-            if (cpu.A[i])
-                cpu.zero_suppr = 0;
+            bus->display_digit = '0' + a;
+            if (a)
+                cpu->zero_suppr = 0;
         }
         bus->display_dpt = 0;
         bus->display_segH = 0;
-        if (cpu.R5 == i)
+        if (cpu->R5 == i)
             bus->display_dpt = 1;
         //XXX
         //D15 is wrong, but not really used
-        if (cpu.fA & (1<<(i+1)))
+        if (cpu->fA & (1<<(i+1)))
             bus->display_segH = 1;
 #endif
     }
     else {
 #if 0
         /* output at Srate */
-        if (cpu.fA)
+        if (cpu->fA)
             bus->display_segH = 1;
 #else
         /* limit display refresh */
@@ -765,157 +1000,341 @@ static void alu_gen_digit(struct bus *bus)
     }
 }
 
-static int alu_process(void *priv, struct bus *bus)
+static int alu_dump_state(void *priv, struct bus *bus, FILE *f)
 {
-    cpu.digit = bus->dstate;
-    cpu.EXT = bus->ext;
-    cpu.key = bus->key_line;
-
-    if (cpu.reset) {
-        if (bus->sstate == 0 && bus->write && cpu.reset-- > 1)
-            bus->ext = 1;
-        else if (bus->sstate == 15 && !bus->write && cpu.reset == 1) {
-            cpu.opcode = bus->irg;
-            cpu.addr = bus->addr;
-            if (bus->addr == -1)
-                return 1;
-        }
-        return 0;
+    struct alu *cpu = priv;
+    fprintf(f, "A=%016llX B=%016llX C=%016llX D=%016llX E=%016llX",
+            (unsigned long long)cpu->A, (unsigned long long)cpu->B,
+            (unsigned long long)cpu->C, (unsigned long long)cpu->D,
+            (unsigned long long)cpu->E);
+    fprintf(f, "\nFA=%04X FB=%04X KR=%04X SR=%04X R5=%X FLAGS=%04X D%02d\n",
+            cpu->fA, cpu->fB, cpu->KR, cpu->SR, cpu->R5, cpu->flags, cpu->digit);
+    return 0;
+}
+
+/* reg[] pointers are not saved */
+static int alu_save(void *priv, FILE *f)
+{
+    return snap_put(f, priv, offsetof(struct alu, reg));
+}
+
+static int alu_restore(void *priv, FILE *f)
+{
+    return snap_get(f, priv, offsetof(struct alu, reg));
+}
+
+/* return 1 if still in reset */
+static int alu_reset(struct alu *cpu, struct bus *bus, int *ret)
+{
+    *ret = 0;
+    if (bus->sstate == 0 && bus->write && cpu->reset-- > 1)
+        bus->ext = 1;
+    else if (bus->sstate == 15 && !bus->write && cpu->reset == 1) {
+        cpu->opcode = bus->irg;
+        cpu->addr = bus->addr;
+        if (bus->addr == -1)
+            *ret = 1;
     }
+    return 1;
+}
 
-    if (bus->sstate == 0 && bus->write) {
-        debug(cpu.addr, cpu.opcode);
-        cpu.flags &= ~FLG_HOLD;
-        memset(cpu.Sin, 0, sizeof(cpu.Sin));
-        memset(cpu.Sout, 0, sizeof(cpu.Sin));
-        if (cpu.flags & FLG_COND)
-            cpu.flags |= FLG_COND_LAST;
-
-        //XXX D change at S15W. But last alu input S15R
-        //TODO update digit, dpt, segH here...
-        alu_gen_digit(bus);
-
-        /* we need to run here :
-         * instruction that set HOLD (need S2W)
-         * alu operation that write io (need S0W)
-         * instruction that change KR (need SxW)
-         * instruction that set PREG (need S0W)
-         *
-         * we don't want to run here :
-         * instruction that read io
-         * instruction that read ext
-         */
-        if (run_early(cpu.opcode)) {
-            execute(cpu.opcode);
-            if (cpu.flags & FLG_IO_VALID) {
-                memcpy(bus->io, cpu.Sout,  sizeof(bus->io));
-                cpu.flags &= ~FLG_IO_VALID;
-            }
+static void alu_trace(struct alu *cpu, struct machine *m)
+{
+    struct trace_rec *r = trace_next(m->trace);
+
+    r->cycle = m->cycle;
+    r->A = cpu->A;
+    r->B = cpu->B;
+    r->C = cpu->C;
+    r->D = cpu->D;
+    r->E = cpu->E;
+    r->Sin = cpu->Sin;
+    r->Sout = cpu->Sout;
+    r->addr = cpu->addr;
+    r->opcode = cpu->opcode;
+    r->state = ((cpu->flags & FLG_COND) ? TRACE_COND : 0) |
+        ((cpu->flags & FLG_IDLE) ? TRACE_IDLE : 0) |
+        ((cpu->flags & FLG_HOLD) ? TRACE_HOLD : 0);
+    r->fA = cpu->fA;
+    r->fB = cpu->fB;
+    r->KR = cpu->KR;
+    r->SR = cpu->SR;
+    r->EXT = cpu->EXT;
+    r->digit = cpu->digit;
+    r->R5 = cpu->R5;
+}
+
+static void alu_s0w(struct alu *cpu, struct bus *bus)
+{
+    cpu->trace = bus->machine->trace != NULL;
+    if (cpu->trace)
+        alu_trace(cpu, bus->machine);
+    debug(cpu, cpu->addr, cpu->opcode);
+    cpu->flags &= ~FLG_HOLD;
+    cpu->Sin = 0;
+    cpu->Sout = 0;
+    if (cpu->flags & FLG_COND)
+        cpu->flags |= FLG_COND_LAST;
+
+    //XXX D change at S15W. But last alu input S15R
+    //TODO update digit, dpt, segH here...
+    alu_gen_digit(cpu, bus);
+
+    /* we need to run here :
+     * instruction that set HOLD (need S2W)
+     * alu operation that write io (need S0W)
+     * instruction that change KR (need SxW)
+     * instruction that set PREG (need S0W)
+     *
+     * we don't want to run here :
+     * instruction that read io
+     * instruction that read ext
+     */
+    if (uop_get(cpu->opcode)->early) {
+        execute(cpu, cpu->opcode);
+        if (cpu->flags & FLG_IO_VALID) {
+            for (int i = 0; i < 16; i++)
+                bus->io[i] = DIGIT(cpu->Sout, i);
+            cpu->flags &= ~FLG_IO_VALID;
         }
-        /* Output KR, unless MOV     KR,EXT[4..15]
-         * We need to send KR from current cycle :
-         * - KR[1]/PREG need to be set during SET KR[1] cycle
-         * - Printer code need it
-         *   -- instruction changing KR on alu/PRINTER instructions on irg
-         *   according to ti59 service manual. PRINTER instructions use ext data
-         *   from irg PRINTER instructions Dcycle.
-         *   -- running test, show that code modify KR one instruction before printer one
-         *   and we need the updated KR for correct print
-         */
-        if (cpu.opcode != 0x0A0C)
-            bus->ext = ((cpu.KR >> 1) | (cpu.KR << 15)) & 0xFFF9;
     }
-    else if (bus->sstate == 1 && bus->write) {
-        /* Set COND flags from previous cycle.
-         * XXX in realy hardware, current COND is delayed ?
-         * Other peripheral can also set it
-         * read by xrom
-         */
-        if (cpu.flags & FLG_COND_LAST) {
-            bus->ext |= EXT_COND;
-            cpu.flags &= ~FLG_COND_LAST;
-        }
+    /* Output KR, unless MOV     KR,EXT[4..15]
+     * We need to send KR from current cycle :
+     * - KR[1]/PREG need to be set during SET KR[1] cycle
+     * - Printer code need it
+     *   -- instruction changing KR on alu/PRINTER instructions on irg
+     *   according to ti59 service manual. PRINTER instructions use ext data
+     *   from irg PRINTER instructions Dcycle.
+     *   -- running test, show that code modify KR one instruction before printer one
+     *   and we need the updated KR for correct print
+     */
+    if (cpu->opcode != 0x0A0C)
+        bus->ext = ((cpu->KR >> 1) | (cpu->KR << 15)) & 0xFFF9;
+}
+
+static void alu_s1w(struct alu *cpu, struct bus *bus)
+{
+    /* Set COND flags from previous cycle.
+     * XXX in realy hardware, current COND is delayed ?
+     * Other peripheral can also set it
+     * read by xrom
+     */
+    if (cpu->flags & FLG_COND_LAST) {
+        bus->ext |= EXT_COND;
+        cpu->flags &= ~FLG_COND_LAST;
     }
-    else if (bus->sstate == 2 && bus->write) {
-        if (cpu.flags & FLG_HOLD) {
-            bus->ext |= EXT_HOLD;
-        }
+}
+
+static void alu_s2w(struct alu *cpu, struct bus *bus)
+{
+    if (cpu->flags & FLG_HOLD) {
+        bus->ext |= EXT_HOLD;
     }
-    else if (bus->sstate == 2 && !bus->write) {
-        if ((bus->ext & EXT_HOLD) == 0) {
-            // clear PREG bit if bus is not hold
-            cpu.KR &= ~0x2;
-        }
+}
+
+static void alu_s2r(struct alu *cpu, struct bus *bus)
+{
+    if ((bus->ext & EXT_HOLD) == 0) {
+        // clear PREG bit if bus is not hold
+        cpu->KR &= ~0x2;
     }
-    else if (bus->sstate == 14 && bus->write) {
-        /* clear segment before D line switch */
-        bus->display_dpt = 0;
-        bus->display_segH = 0;
-        bus->display_digit = ' ';
+}
+
+static void alu_s14w(struct bus *bus)
+{
+    /* clear segment before D line switch */
+    bus->display_dpt = 0;
+    bus->display_segH = 0;
+    bus->display_digit = ' ';
+}
+
+/* some alu operation depends on IO and other write to IO
+ * dst IO : xxx001
+ * */
+static int alu_s15r(struct alu *cpu, struct bus *bus)
+{
+    if (!uop_get(cpu->opcode)->early) {
+        cpu->Sin = 0;
+        for (int i = 0; i < 16; i++)
+            cpu->Sin |= (uint64_t)(bus->io[i] & 0x0F) << (4 * i);
+        execute(cpu, cpu->opcode);
     }
-    /* some alu operation depends on IO and other write to IO
-     * dst IO : xxx001
+    /* save next opcode */
+    cpu->opcode = bus->irg;
+    cpu->addr = bus->addr;
+    /* KR[1] and KR[2] not used. Reuse them to save COND, HOLD ?
+     * XXX check if some KR instruction can clear it
      * */
-    else if (bus->sstate == 15 && !bus->write) {
-        if (!run_early(cpu.opcode)) {
-            memcpy(cpu.Sin,  bus->io, sizeof(bus->io));
-            execute(cpu.opcode);
-        }
-        /* save next opcode */
-        cpu.opcode = bus->irg;
-        cpu.addr = bus->addr;
-        /* KR[1] and KR[2] not used. Reuse them to save COND, HOLD ?
-         * XXX check if some KR instruction can clear it
-         * */
 
-        if (bus->addr == -1)
-            return 1;
+    if (bus->addr == -1)
+        return 1;
+    return 0;
+}
+
+static int alu_process(void *priv, struct bus *bus)
+{
+    struct alu *cpu = priv;
+    int ret = 0;
+
+    cpu->digit = bus->dstate;
+    cpu->EXT = bus->ext;
+    cpu->key = bus->key_line;
+
+    if (cpu->reset && alu_reset(cpu, bus, &ret))
+        return ret;
+
+    if (bus->sstate == 0 && bus->write)
+        alu_s0w(cpu, bus);
+    else if (bus->sstate == 1 && bus->write)
+        alu_s1w(cpu, bus);
+    else if (bus->sstate == 2 && bus->write)
+        alu_s2w(cpu, bus);
+    else if (bus->sstate == 2 && !bus->write)
+        alu_s2r(cpu, bus);
+    else if (bus->sstate == 14 && bus->write)
+        alu_s14w(bus);
+    else if (bus->sstate == 15 && !bus->write)
+        ret = alu_s15r(cpu, bus);
+
+    bus->idle = cpu->flags & FLG_IDLE;
+
+
+    return ret;
+}
+
+/* instruction level model (fast engine) :
+ * write : S0W..S14W, read : S0R..S14R, then S15R
+ */
+static int alu_step(void *priv, struct bus *bus)
+{
+    struct alu *cpu = priv;
+    int ret = 0;
+
+    cpu->digit = bus->dstate;
+    cpu->EXT = bus->ext;
+    cpu->key = bus->key_line;
+
+    if (cpu->reset && alu_reset(cpu, bus, &ret))
+        return ret;
+
+    if (bus->sstate == 15)
+        ret = alu_s15r(cpu, bus);
+    else if (bus->write) {
+        /* S14W of previous cycle : nobody read display
+         * between S14W and S0W
+         */
+        alu_s14w(bus);
+        alu_s0w(cpu, bus);
+        alu_s1w(cpu, bus);
+        alu_s2w(cpu, bus);
     }
+    else
+        alu_s2r(cpu, bus);
 
-    bus->idle = cpu.flags & FLG_IDLE;
+    bus->idle = cpu->flags & FLG_IDLE;
 
+    return ret;
+}
 
+/* the instruction holding the bus holds again at this digit */
+static int alu_holds(struct alu *cpu)
+{
+    const struct uop *u = uop_get(cpu->opcode);
+
+    if (u->fn == op_key_scan) {
+        unsigned char mask = u->arg & cpu->key;
+        if (mask & (mask - 1))
+            mask = 0;
+        return !(cpu->key & mask) && cpu->digit != 15;
+    }
+    if (u->fn == op_wait_digit)
+        return cpu->digit != u->arg;
+    return 0;
+}
+
+/* fast engine : cycle of an instruction holding the bus (see run_hold).
+ * Same bus output as alu_step, without executing the instruction.
+ * Return 1 if the instruction doesn't hold at this digit.
+ */
+static int alu_hold(void *priv, struct bus *bus)
+{
+    struct alu *cpu = priv;
+
+    if (bus->sstate != 0)
+        return 0;
+    cpu->digit = bus->dstate;
+    cpu->EXT = bus->ext;
+    cpu->key = bus->key_line;
+    if (!alu_holds(cpu))
+        return 1;
+
+    alu_s14w(bus);
+    alu_gen_digit(cpu, bus);
+    bus->ext = ((cpu->KR >> 1) | (cpu->KR << 15)) & 0xFFF9;
+    if (cpu->flags & FLG_COND)
+        bus->ext |= EXT_COND;
+    bus->ext |= EXT_HOLD;
+    bus->idle = cpu->flags & FLG_IDLE;
     return 0;
 }
 
 int alu_init(struct chip *chip)
 {
+    struct alu *cpu = calloc(1, sizeof(*cpu));
+
+    if (!cpu)
+        return -1;
+    decode_init();
+    cpu->reg[REG_A] = &cpu->A;
+    cpu->reg[REG_B] = &cpu->B;
+    cpu->reg[REG_C] = &cpu->C;
+    cpu->reg[REG_D] = &cpu->D;
+    cpu->reg[REG_E] = &cpu->E;
+
     /* force preg 0 */
-    //cpu.KR = 2;
+    //cpu->KR = 2;
     /* set cond for easy compare with other logs */
-    cpu.flags |= FLG_COND;
+    cpu->flags |= FLG_COND;
 #if 0
     /* ti5230 do not clear anything ... */
-    memset(cpu.A, 0xE, sizeof(cpu.A));
-    memset(cpu.B, 0xE, sizeof(cpu.B));
+    cpu->A = 0xEEEEEEEEEEEEEEEEULL;
+    cpu->B = 0xEEEEEEEEEEEEEEEEULL;
     /* ti58 is doing ADD     IO.ALL,C,#0
      * in init sequence. This clear COND
      * with EE..EE init
      */
-    memset(cpu.C, 0x5, sizeof(cpu.B));
-    memset(cpu.D, 0xE, sizeof(cpu.B));
-    memset(cpu.E, 0xE, sizeof(cpu.B));
-    cpu.SR = 0XDEAD;
-    cpu.fA = 0XDEAD;
-    cpu.fB = 0XDEAD;
+    cpu->C = 0x5555555555555555ULL;
+    cpu->D = 0xEEEEEEEEEEEEEEEEULL;
+    cpu->E = 0xEEEEEEEEEEEEEEEEULL;
+    cpu->SR = 0XDEAD;
+    cpu->fA = 0XDEAD;
+    cpu->fB = 0XDEAD;
     /* SR51 don't clear KR */
-    //cpu.KR = 0xDEAD;
-    cpu.R5 = 0xE;
+    //cpu->KR = 0xDEAD;
+    cpu->R5 = 0xE;
 #else
-    memset(cpu.A, 0x0, sizeof(cpu.A));
-    memset(cpu.B, 0x0, sizeof(cpu.B));
-    memset(cpu.C, 0x0, sizeof(cpu.B));
-    memset(cpu.D, 0x0, sizeof(cpu.B));
-    memset(cpu.E, 0x0, sizeof(cpu.B));
-    cpu.SR = 0;
-    cpu.fA = 0;
-    cpu.fB = 0;
-    //cpu.KR |= 0xDE00;
-    cpu.R5 = 0;
+    cpu->A = 0;
+    cpu->B = 0;
+    cpu->C = 0;
+    cpu->D = 0;
+    cpu->E = 0;
+    cpu->SR = 0;
+    cpu->fA = 0;
+    cpu->fB = 0;
+    //cpu->KR |= 0xDE00;
+    cpu->R5 = 0;
 #endif
-    cpu.reset = 5;
+    cpu->reset = 5;
 
+    chip->priv = cpu;
     chip->process = alu_process;
+    chip->step = alu_step;
+    chip->hold = alu_hold;
+    chip->dump_state = alu_dump_state;
+    chip->save = alu_save;
+    chip->restore = alu_restore;
+    chip->slots = SLOT(0, 1) | SLOT(1, 1) | SLOT(2, 1) | SLOT(2, 0) |
+        SLOT(14, 1) | SLOT(15, 0);
     printf("alu init\n");
     return 0;
 }
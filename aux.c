@@ -21,12 +21,11 @@
 #include <string.h>
 #include "emu.h"
 
-static struct {
-    char out[17];
-    int nidle;
-    int data;
-    int pos;
-} disp;
+static const struct chip_irg aux_irg[] = {
+    {0xFFFF, 0x0AE8},
+    {0xFFFF, 0x0AD8},
+    {0, 0}
+};
 
 static int display_process(void *priv, struct bus *bus)
 {
@@ -46,6 +45,8 @@ static int display_process(void *priv, struct bus *bus)
 int aux_init(struct chip *chip, const char *name)
 {
     chip->process = display_process;
+    chip->slots = SLOT(15, 0);
+    chip->irg = aux_irg;
 
     return 0;
 }
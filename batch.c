@@ -0,0 +1,602 @@
+/*
+ * Copyright (C) 2024 by Matthieu CASTET <castet.matthieu@free.fr>
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "emu.h"
+
+/**
+ * Batch mode : run many independent machines on a thread pool.
+ *
+ * job file, one job per line ('#' for comment) :
+ *   name keys_file options
+ * options are the chip options of the command line (-r, -s, -k, -R, ...).
+ * A job stops at the end of keys_file (or after -n cycles).
+ *
+ * exit status of a job in the report :
+ *   0 : ran until the end of keys_file, or -n cycles
+ *   1 : could not run (keys file, chip options, snapshot)
+ *   other : error returned by a chip, usually -1
+ *
+ * Each worker has its own queue of jobs. It takes jobs from the back of
+ * its queue, and once empty, steals from the front of the other ones.
+ * The report is printed in job order once all jobs are done.
+ *
+ * With --fork, the jobs run in processes instead : one machine per set
+ * of chip options (model) is booted until it waits for a key, then
+ * each job is a fork() of this warm machine, that only runs the keys
+ * of the job. The child sends back its result on a pipe :
+ *   struct batch_result, then the printer tape
+ */
+
+#define JOB_ARGS_MAX 64
+
+struct batch_job {
+    char *line;
+    const char *name;
+    const char *keys;
+    int argc;
+    char *argv[JOB_ARGS_MAX + 1];
+
+    /* result */
+    int ret;
+    unsigned long long cycle;
+    char display[32];
+    char *tape;
+    size_t tape_len;
+};
+
+struct batch_result {
+    int ret;
+    unsigned long long cycle;
+    char display[32];
+};
+
+struct batch_model {
+    char *options;
+    struct machine *m;
+    int fd;
+    /* boot result, RUN_KEY_WAIT once warm */
+    int ret;
+};
+
+/* running fork */
+struct batch_child {
+    int job;
+    pid_t pid;
+    int fd;
+    char *buf;
+    size_t len, size;
+};
+
+struct batch_queue {
+    pthread_mutex_t lock;
+    int *jobs;
+    int head, tail;
+};
+
+struct batch {
+    struct batch_job *jobs;
+    int jobs_num;
+    struct batch_queue *queues;
+    int threads;
+    int fast;
+    unsigned long long cycle_max;
+    struct batch_model *models;
+    int models_num;
+};
+
+/* chip init use getopt and print on stdout */
+static pthread_mutex_t setup_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int batch_parse(struct batch_job *job, char *line)
+{
+    char *save;
+    char *tok;
+
+    job->line = line;
+    job->argc = 0;
+    job->argv[job->argc++] = "main";
+    job->name = strtok_r(line, " \t\n", &save);
+    if (!job->name || job->name[0] == '#')
+        return 1;
+    job->keys = strtok_r(NULL, " \t\n", &save);
+    if (!job->keys)
+        return -1;
+    while ((tok = strtok_r(NULL, " \t\n", &save))) {
+        if (job->argc >= JOB_ARGS_MAX)
+            return -1;
+        job->argv[job->argc++] = tok;
+    }
+    job->argv[job->argc] = NULL;
+    return 0;
+}
+
+static int batch_load(struct batch *b, const char *name)
+{
+    FILE *f = fopen(name, "r");
+    char *line = NULL;
+    size_t size = 0;
+    int num = 0;
+
+    if (!f) {
+        printf("can't open batch file '%s'\n", name);
+        return -1;
+    }
+    while (getline(&line, &size, f) >= 0) {
+        struct batch_job *job;
+        int ret;
+
+        b->jobs = realloc(b->jobs, sizeof(*b->jobs) * (b->jobs_num + 1));
+        job = &b->jobs[b->jobs_num];
+        memset(job, 0, sizeof(*job));
+        num++;
+        ret = batch_parse(job, line);
+        if (ret < 0) {
+            printf("batch line %d: invalid job\n", num);
+            free(line);
+            fclose(f);
+            return -1;
+        }
+        if (ret == 0) {
+            b->jobs_num++;
+            /* line is now owned by job */
+            line = NULL;
+            size = 0;
+        }
+    }
+    free(line);
+    fclose(f);
+    return 0;
+}
+
+static void batch_job_run(struct batch *b, struct batch_job *job)
+{
+    struct machine *m;
+    int fd;
+    int ret;
+
+    job->ret = 1;
+    m = machine_new();
+    if (!m)
+        return;
+    fd = open(job->keys, O_RDONLY);
+    m->out = fopen("/dev/null", "w");
+    m->tape = open_memstream(&job->tape, &job->tape_len);
+    if (fd < 0 || !m->out || !m->tape)
+        goto out;
+    m->in_fd = fd;
+    m->cycle_max = b->cycle_max;
+    m->job = job->name;
+
+    pthread_mutex_lock(&setup_lock);
+    ret = machine_setup(m, job->argc, job->argv, 0, 0);
+    pthread_mutex_unlock(&setup_lock);
+    if (ret)
+        goto out;
+
+    job->ret = machine_run(m, b->fast);
+    job->cycle = m->cycle;
+    snprintf(job->display, sizeof(job->display), "%s", display_debug(m));
+
+out:
+    if (fd >= 0)
+        close(fd);
+    if (m->out)
+        fclose(m->out);
+    if (m->tape)
+        fclose(m->tape);
+    machine_free(m);
+}
+
+/* own queue : take from the back */
+static int batch_pop(struct batch_queue *q)
+{
+    int job = -1;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->tail > q->head)
+        job = q->jobs[--q->tail];
+    pthread_mutex_unlock(&q->lock);
+    return job;
+}
+
+/* other queue : steal from the front */
+static int batch_steal(struct batch_queue *q)
+{
+    int job = -1;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->tail > q->head)
+        job = q->jobs[q->head++];
+    pthread_mutex_unlock(&q->lock);
+    return job;
+}
+
+struct batch_worker {
+    struct batch *b;
+    int id;
+    pthread_t thread;
+};
+
+static void *batch_worker(void *arg)
+{
+    struct batch_worker *w = arg;
+    struct batch *b = w->b;
+
+    while (1) {
+        int job = batch_pop(&b->queues[w->id]);
+
+        /* jobs never add jobs : all queues empty means done */
+        for (int i = 1; job < 0 && i < b->threads; i++)
+            job = batch_steal(&b->queues[(w->id + i) % b->threads]);
+        if (job < 0)
+            break;
+        batch_job_run(b, &b->jobs[job]);
+    }
+    return NULL;
+}
+
+/* jobs with the same options share a model */
+static char *batch_options(struct batch_job *job)
+{
+    size_t len = 1;
+    char *s;
+
+    for (int i = 1; i < job->argc; i++)
+        len += strlen(job->argv[i]) + 1;
+    s = malloc(len);
+    if (!s)
+        return NULL;
+    s[0] = '\0';
+    for (int i = 1; i < job->argc; i++) {
+        strcat(s, job->argv[i]);
+        strcat(s, "\n");
+    }
+    return s;
+}
+
+/* boot a model until it waits for a key, without input */
+static int batch_boot(struct batch *b, struct batch_model *model,
+        struct batch_job *job)
+{
+    struct machine *m = machine_new();
+    int ret;
+
+    model->m = m;
+    model->fd = -1;
+    if (!m)
+        return 1;
+    model->fd = open("/dev/null", O_RDONLY);
+    m->out = fopen("/dev/null", "w");
+    if (model->fd < 0 || !m->out)
+        return 1;
+    m->in_fd = model->fd;
+    m->cycle_max = b->cycle_max;
+    if (machine_setup(m, job->argc, job->argv, 0, 0))
+        return 1;
+    m->stop_key_wait = 1;
+    ret = b->fast ? run_fast(m) : run(m);
+    return ret == RUN_END_OF_INPUT ? 0 : ret;
+}
+
+static struct batch_model *batch_model(struct batch *b, struct batch_job *job)
+{
+    struct batch_model *model;
+    char *options = batch_options(job);
+
+    if (!options)
+        return NULL;
+    for (int i = 0; i < b->models_num; i++) {
+        if (!strcmp(b->models[i].options, options)) {
+            free(options);
+            return &b->models[i];
+        }
+    }
+    b->models = realloc(b->models, sizeof(*b->models) * (b->models_num + 1));
+    model = &b->models[b->models_num++];
+    memset(model, 0, sizeof(*model));
+    model->options = options;
+    model->ret = batch_boot(b, model, job);
+    return model;
+}
+
+/* result of a job that was not forked */
+static void batch_result(struct batch_job *job, struct batch_model *model)
+{
+    struct machine *m = model->m;
+
+    job->ret = model->ret;
+    if (!m || !m->started)
+        return;
+    job->cycle = m->cycle;
+    snprintf(job->display, sizeof(job->display), "%s", display_debug(m));
+}
+
+/* in the child : run the job on the warm machine and send the result */
+static void batch_fork_child(struct batch *b, struct batch_job *job,
+        struct machine *m, int out)
+{
+    struct batch_result res;
+    FILE *f;
+    int fd = open(job->keys, O_RDONLY);
+
+    if (fd < 0 || dup2(fd, m->in_fd) < 0)
+        _exit(2);
+    close(fd);
+    m->job = job->name;
+    m->tape = open_memstream(&job->tape, &job->tape_len);
+    if (!m->tape)
+        _exit(2);
+    memset(&res, 0, sizeof(res));
+    res.ret = machine_run(m, b->fast);
+    res.cycle = m->cycle;
+    snprintf(res.display, sizeof(res.display), "%s", display_debug(m));
+    fclose(m->tape);
+
+    f = fdopen(out, "w");
+    if (!f || fwrite(&res, sizeof(res), 1, f) != 1 ||
+            fwrite(job->tape, 1, job->tape_len, f) != job->tape_len ||
+            fclose(f))
+        _exit(2);
+    _exit(0);
+}
+
+static int batch_fork(struct batch *b, struct batch_child *c, int job)
+{
+    struct batch_model *model = batch_model(b, &b->jobs[job]);
+    int p[2];
+
+    memset(c, 0, sizeof(*c));
+    c->job = job;
+    c->fd = -1;
+    if (!model) {
+        b->jobs[job].ret = 1;
+        return 0;
+    }
+    if (model->ret != RUN_KEY_WAIT) {
+        batch_result(&b->jobs[job], model);
+        return 0;
+    }
+    if (pipe(p))
+        return -1;
+    fflush(NULL);
+    c->pid = fork();
+    if (c->pid < 0) {
+        close(p[0]);
+        close(p[1]);
+        return -1;
+    }
+    if (c->pid == 0) {
+        close(p[0]);
+        batch_fork_child(b, &b->jobs[job], model->m, p[1]);
+    }
+    close(p[1]);
+    c->fd = p[0];
+    return 1;
+}
+
+/* child output complete */
+static void batch_fork_done(struct batch *b, struct batch_child *c)
+{
+    struct batch_job *job = &b->jobs[c->job];
+    struct batch_result res;
+    int status;
+
+    close(c->fd);
+    waitpid(c->pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) ||
+            c->len < sizeof(res)) {
+        /* the child exits with 2 if it can't run the job */
+        job->ret = WIFEXITED(status) && WEXITSTATUS(status) == 2 ? 1 : -1;
+        free(c->buf);
+        return;
+    }
+    memcpy(&res, c->buf, sizeof(res));
+    job->ret = res.ret;
+    job->cycle = res.cycle;
+    memcpy(job->display, res.display, sizeof(job->display));
+    job->tape_len = c->len - sizeof(res);
+    memmove(c->buf, c->buf + sizeof(res), job->tape_len);
+    job->tape = c->buf;
+}
+
+/* at most b->threads children at a time */
+static int batch_fork_run(struct batch *b)
+{
+    struct batch_child *child = calloc(b->threads, sizeof(*child));
+    struct pollfd *fds = calloc(b->threads, sizeof(*fds));
+    int running = 0;
+    int next = 0;
+    int ret = 0;
+
+    if (!child || !fds)
+        return 1;
+    while (next < b->jobs_num || running) {
+        while (next < b->jobs_num && running < b->threads && !ret) {
+            int r = batch_fork(b, &child[running], next++);
+            if (r < 0)
+                ret = 1;
+            else if (r > 0)
+                running++;
+        }
+        if (ret && !running)
+            break;
+        if (running <= 0)
+            continue;
+
+        for (int i = 0; i < running; i++) {
+            fds[i].fd = child[i].fd;
+            fds[i].events = POLLIN;
+        }
+        if (poll(fds, running, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            ret = 1;
+            break;
+        }
+        for (int i = running - 1; i >= 0; i--) {
+            struct batch_child *c = &child[i];
+            ssize_t n;
+
+            if (!fds[i].revents)
+                continue;
+            if (c->size - c->len < 4096) {
+                c->size = c->len + 65536;
+                c->buf = realloc(c->buf, c->size);
+            }
+            n = read(c->fd, c->buf + c->len, c->size - c->len);
+            if (n > 0) {
+                c->len += n;
+                continue;
+            }
+            if (n < 0 && errno == EINTR)
+                continue;
+            batch_fork_done(b, c);
+            child[i] = child[--running];
+        }
+    }
+
+    for (int i = 0; i < running; i++) {
+        kill(child[i].pid, SIGKILL);
+        waitpid(child[i].pid, NULL, 0);
+        close(child[i].fd);
+        free(child[i].buf);
+    }
+    for (int i = 0; i < b->models_num; i++) {
+        struct batch_model *model = &b->models[i];
+        if (model->m) {
+            if (model->m->out)
+                fclose(model->m->out);
+            machine_free(model->m);
+        }
+        if (model->fd >= 0)
+            close(model->fd);
+        free(model->options);
+    }
+    free(b->models);
+    free(child);
+    free(fds);
+    return ret;
+}
+
+static void batch_report(struct batch *b)
+{
+    for (int i = 0; i < b->jobs_num; i++) {
+        struct batch_job *job = &b->jobs[i];
+        printf("job %s\n", job->name);
+        printf("exit %d\n", job->ret);
+        printf("cycles %llu\n", job->cycle);
+        printf("display '%s'\n", job->display);
+        printf("tape\n");
+        if (job->tape_len)
+            fwrite(job->tape, 1, job->tape_len, stdout);
+        printf("end\n");
+    }
+}
+
+int batch_run(const char *name, int threads, int fast,
+        unsigned long long cycle_max, int pool)
+{
+    struct batch b = {
+        .fast = fast,
+        .cycle_max = cycle_max,
+    };
+    struct batch_worker *workers;
+    int out, null;
+    int ret = 0;
+
+    if (batch_load(&b, name))
+        return 1;
+    if (threads < 1)
+        threads = 1;
+    if (threads > b.jobs_num && b.jobs_num)
+        threads = b.jobs_num;
+    b.threads = threads;
+
+    /* round robin over the worker queues */
+    b.queues = calloc(threads, sizeof(*b.queues));
+    workers = calloc(threads, sizeof(*workers));
+    if (!b.queues || !workers)
+        return 1;
+    for (int i = 0; i < threads; i++) {
+        pthread_mutex_init(&b.queues[i].lock, NULL);
+        b.queues[i].jobs = malloc(sizeof(int) * (b.jobs_num / threads + 1));
+    }
+    for (int i = 0; i < b.jobs_num; i++) {
+        struct batch_queue *q = &b.queues[i % threads];
+        q->jobs[q->tail++] = i;
+    }
+
+    /* chip init messages are not part of the report */
+    fflush(stdout);
+    out = dup(1);
+    null = open("/dev/null", O_WRONLY);
+    if (out < 0 || null < 0)
+        return 1;
+    dup2(null, 1);
+    close(null);
+
+    if (pool) {
+        ret = batch_fork_run(&b);
+    }
+    else {
+        int started;
+
+        for (started = 0; started < threads; started++) {
+            workers[started].b = &b;
+            workers[started].id = started;
+            if (pthread_create(&workers[started].thread, NULL, batch_worker,
+                        &workers[started]))
+                break;
+        }
+        /* the started workers steal the jobs of the missing ones */
+        if (!started)
+            batch_worker(&workers[0]);
+        for (int i = 0; i < started; i++)
+            pthread_join(workers[i].thread, NULL);
+    }
+
+    fflush(stdout);
+    dup2(out, 1);
+    close(out);
+    batch_report(&b);
+
+    for (int i = 0; i < threads; i++) {
+        pthread_mutex_destroy(&b.queues[i].lock);
+        free(b.queues[i].jobs);
+    }
+    for (int i = 0; i < b.jobs_num; i++) {
+        free(b.jobs[i].line);
+        free(b.jobs[i].tape);
+    }
+    free(b.jobs);
+    free(b.queues);
+    free(workers);
+    return ret;
+}
@@ -65,12 +65,8 @@ static unsigned int handle_branch(const struct brom_state *bstate, int cond)
 	return bstate->pc + 1;
 }
 
-static void brom_process_out(struct brom_state *bstate, struct bus *bus_state)
+static void brom_fetch(struct brom_state *bstate, struct bus *bus_state)
 {
-    /* optimisation output state early. S4 */
-    if (bus_state->sstate != 4)
-        return;
-
     /* with is implementation, the cpu
      * nHOLD(ext) WAIT(irg) XXXX (exec)
      * HOLD(ext) WAIT(irg)  WAIT (exec)
@@ -121,10 +117,24 @@ static void brom_process_out(struct brom_state *bstate, struct bus *bus_state)
         assert(bus_state->irg == 0);
         bus_state->irg = bstate->data[addr];
         bus_state->addr = addr + bstate->start;
+        if (bus_state->machine->profile)
+            profile_hit(bus_state->machine->profile, bus_state->addr,
+                    bus_state->irg);
+        if (bus_state->machine->coverage)
+            coverage_hit(bus_state->machine->coverage->rom_hit,
+                    bus_state->addr);
         //DIS("addr%d new irg%04x\n", addr, bus_state->irg);
     }
 }
 
+static void brom_process_out(struct brom_state *bstate, struct bus *bus_state)
+{
+    /* optimisation output state early. S4 */
+    if (bus_state->sstate != 4)
+        return;
+    brom_fetch(bstate, bus_state);
+}
+
 static void brom_process_in(struct brom_state *bstate, struct bus *bus_state)
 {
     /* optimisation. Read output at last state */
@@ -146,6 +156,51 @@ static int brom_process(void *priv, struct bus *bus_state)
     return 0;
 }
 
+static int brom_dump_state(void *priv, struct bus *bus, FILE *f)
+{
+    struct brom_state *bstate = priv;
+    fprintf(f, "PC=%04X\n", bstate->pc);
+    return 0;
+}
+
+static int brom_save(void *priv, FILE *f)
+{
+    struct brom_state *bstate = priv;
+    int ret = 0;
+    ret |= SNAP_PUT(f, bstate->pc);
+    ret |= SNAP_PUT(f, bstate->last_ext);
+    ret |= SNAP_PUT(f, bstate->last_irg);
+    return ret;
+}
+
+static int brom_restore(void *priv, FILE *f)
+{
+    struct brom_state *bstate = priv;
+    int ret = 0;
+    ret |= SNAP_GET(f, bstate->pc);
+    ret |= SNAP_GET(f, bstate->last_ext);
+    ret |= SNAP_GET(f, bstate->last_irg);
+    return ret;
+}
+
+static void brom_coverage(void *priv, struct coverage *c)
+{
+    struct brom_state *bstate = priv;
+    coverage_set(c->rom, bstate->start, bstate->end);
+}
+
+/* instruction level model (fast engine) */
+static int brom_step(void *priv, struct bus *bus_state)
+{
+    struct brom_state *bstate = priv;
+    if (bus_state->write)
+        brom_fetch(bstate, bus_state);
+    else
+        brom_process_in(bstate, bus_state);
+
+    return 0;
+}
+
 static void dis(struct brom_state *bstate)
 {
     int addr;
@@ -189,5 +244,11 @@ int brom_init(struct chip *chip, const char *name, int disasm)
     }
     chip->priv = bstate;
     chip->process = brom_process;
+    chip->step = brom_step;
+    chip->dump_state = brom_dump_state;
+    chip->save = brom_save;
+    chip->restore = brom_restore;
+    chip->coverage = brom_coverage;
+    chip->slots = SLOT(4, 1) | SLOT(15, 0);
     return 0;
 }
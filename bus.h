@@ -22,6 +22,7 @@
 
 #include <stdint.h>
 
+struct machine;
 
 struct bus {
 	/* 16 bits from cpu/crom (LSB first on bus S0..S15)
@@ -72,4 +73,7 @@ struct bus {
      * -1 to detect missing instruction.
      */
     int addr;
+
+    /* not a bus signal : calculator owning this bus */
+    struct machine *machine;
 };
@@ -0,0 +1,345 @@
+/*
+ * Copyright (C) 2024 by Matthieu CASTET <castet.matthieu@free.fr>
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include "emu.h"
+
+/**
+ * Lockstep check of the S-state engine against the fast engine.
+ *
+ * The machine is forked after chip init : one child run run(),
+ * the other run_fast(). At the end of each instruction cycle,
+ * children send the state of all chips (dump_state) to the parent,
+ * that stop at the first difference.
+ *
+ * stdin is read by the parent and sent to both children.
+ * The parent stops reading a child that is CHECK_AHEAD bytes of records
+ * ahead of the other one : the pipe blocks it until the other catches up.
+ *
+ * record : uint32_t len, then len bytes of text
+ *   cycle N addr XXXX irg XXXX
+ *   <dump_state of each chip>
+ */
+
+#define CHECK_AHEAD (1 << 20)
+
+/* child side : only one machine per child */
+static char *rec_buf;
+static size_t rec_size;
+static FILE *rec;
+static unsigned long long check_count;
+
+void check_cycle(struct machine *m)
+{
+    struct chip *chips = m->chips;
+    struct bus *bus = &m->bus;
+    uint32_t len;
+
+    rewind(rec);
+    fprintf(rec, "cycle %llu addr %04X irg %04X\n", check_count++,
+            bus->addr & 0xFFFF, bus->irg);
+    for (int i = 0; chips[i].process; i++) {
+        if (chips[i].dump_state)
+            chips[i].dump_state(chips[i].priv, bus, rec);
+    }
+    fflush(rec);
+    len = ftell(rec);
+    fwrite(&len, sizeof(len), 1, m->check_out);
+    fwrite(rec_buf, 1, len, m->check_out);
+}
+
+static void check_child(struct machine *m, int in, int out)
+{
+    dup2(in, m->in_fd);
+    close(in);
+    m->check_out = fdopen(out, "w");
+    rec = open_memstream(&rec_buf, &rec_size);
+    if (!m->check_out || !rec)
+        exit(2);
+}
+
+/* parent side */
+struct check_proc {
+    const char *name;
+    pid_t pid;
+    /* stdin data not yet sent */
+    char *in_buf;
+    size_t in_len;
+    int in_fd;
+    /* records received, compared up to out_pos */
+    char *out_buf;
+    size_t out_pos, out_len, out_size;
+    int out_fd;
+};
+
+static int set_nonblock(int fd)
+{
+    return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+/* start a child. Return 1 in the child */
+static int check_fork(struct machine *m, struct check_proc *p,
+        const char *name)
+{
+    int in[2], out[2];
+
+    memset(p, 0, sizeof(*p));
+    p->name = name;
+    if (pipe(in) || pipe(out))
+        return -1;
+    fflush(NULL);
+    p->pid = fork();
+    if (p->pid < 0)
+        return -1;
+    if (p->pid == 0) {
+        close(in[1]);
+        close(out[0]);
+        check_child(m, in[0], out[1]);
+        return 1;
+    }
+    close(in[0]);
+    close(out[1]);
+    p->in_fd = in[1];
+    p->out_fd = out[0];
+    set_nonblock(p->in_fd);
+    return 0;
+}
+
+/* get next complete record. Return its length or -1 */
+static long check_record(struct check_proc *p, char **data)
+{
+    uint32_t len;
+
+    if (p->out_len - p->out_pos < sizeof(len))
+        return -1;
+    memcpy(&len, p->out_buf + p->out_pos, sizeof(len));
+    if (p->out_len - p->out_pos < sizeof(len) + len)
+        return -1;
+    *data = p->out_buf + p->out_pos + sizeof(len);
+    return len;
+}
+
+static void check_consume(struct check_proc *p, long len)
+{
+    p->out_pos += sizeof(uint32_t) + len;
+}
+
+/* drop compared records, once they use more room than the others */
+static void check_compact(struct check_proc *p)
+{
+    if (p->out_pos < p->out_len - p->out_pos)
+        return;
+    memmove(p->out_buf, p->out_buf + p->out_pos, p->out_len - p->out_pos);
+    p->out_len -= p->out_pos;
+    p->out_pos = 0;
+}
+
+/* records not compared yet, with at least a complete one */
+static size_t check_ahead(struct check_proc *p)
+{
+    char *data;
+
+    if (check_record(p, &data) < 0)
+        return 0;
+    return p->out_len - p->out_pos;
+}
+
+static void check_dump(struct check_proc *p, const char *data, long len)
+{
+    printf("==== %s engine\n", p->name);
+    if (len >= 0)
+        printf("%.*s", (int)len, data);
+    else
+        printf("(stopped)\n");
+}
+
+/* instruction of a record */
+static void check_disasm(const char *rec)
+{
+    unsigned addr, irg;
+    FILE *old_out = log_file;
+
+    if (sscanf(rec, "cycle %*u addr %X irg %X", &addr, &irg) != 2)
+        return;
+    log_file = stdout;
+    printf("==== instruction\n%04X:\t%04X\t", addr, irg);
+    disasm(addr, irg);
+    printf("\n");
+    log_file = old_out;
+}
+
+static int check_parent(struct machine *m, struct check_proc proc[2])
+{
+    int in_eof = 0;
+    int out_eof[2] = {0, 0};
+    char *prev = NULL;
+    unsigned long long count = 0;
+    int ret = 0;
+
+    while (1) {
+        struct pollfd fds[5];
+        int nfds = 0;
+        int idx_in = -1, idx_w[2] = {-1, -1}, idx_r[2] = {-1, -1};
+
+        /* compare all available records */
+        while (1) {
+            char *data[2];
+            long len[2];
+            len[0] = check_record(&proc[0], &data[0]);
+            len[1] = check_record(&proc[1], &data[1]);
+            if ((len[0] < 0 && !out_eof[0]) || (len[1] < 0 && !out_eof[1]))
+                break;
+            if (len[0] < 0 && len[1] < 0) {
+                printf("check : no divergence after %llu cycles\n", count);
+                goto out;
+            }
+            if (len[0] != len[1] || memcmp(data[0], data[1], len[0])) {
+                printf("\ncheck : divergence at cycle %llu\n", count);
+                /* first record : no previous instruction */
+                if (prev)
+                    check_disasm(prev);
+                else
+                    check_disasm(len[0] >= 0 ? data[0] : data[1]);
+                check_dump(&proc[0], data[0], len[0]);
+                check_dump(&proc[1], data[1], len[1]);
+                ret = 1;
+                goto out;
+            }
+            free(prev);
+            prev = strndup(data[0], len[0]);
+            check_consume(&proc[0], len[0]);
+            check_consume(&proc[1], len[1]);
+            count++;
+        }
+
+        if (!in_eof) {
+            idx_in = nfds;
+            fds[nfds].fd = m->in_fd;
+            fds[nfds++].events = POLLIN;
+        }
+        for (int i = 0; i < 2; i++) {
+            if (proc[i].in_len) {
+                idx_w[i] = nfds;
+                fds[nfds].fd = proc[i].in_fd;
+                fds[nfds++].events = POLLOUT;
+            }
+            if (!out_eof[i] && check_ahead(&proc[i]) < CHECK_AHEAD) {
+                idx_r[i] = nfds;
+                fds[nfds].fd = proc[i].out_fd;
+                fds[nfds++].events = POLLIN;
+            }
+        }
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            ret = 2;
+            goto out;
+        }
+
+        if (idx_in >= 0 && fds[idx_in].revents) {
+            char buf[4096];
+            ssize_t n = read(m->in_fd, buf, sizeof(buf));
+            if (n <= 0)
+                in_eof = 1;
+            for (int i = 0; i < 2 && n > 0; i++) {
+                proc[i].in_buf = realloc(proc[i].in_buf, proc[i].in_len + n);
+                memcpy(proc[i].in_buf + proc[i].in_len, buf, n);
+                proc[i].in_len += n;
+            }
+        }
+        for (int i = 0; i < 2; i++) {
+            struct check_proc *p = &proc[i];
+            if (idx_w[i] >= 0 && fds[idx_w[i]].revents) {
+                ssize_t n = write(p->in_fd, p->in_buf, p->in_len);
+                if (n > 0) {
+                    memmove(p->in_buf, p->in_buf + n, p->in_len - n);
+                    p->in_len -= n;
+                }
+                else if (n < 0 && errno != EAGAIN)
+                    p->in_len = 0;
+            }
+            if (idx_r[i] >= 0 && fds[idx_r[i]].revents) {
+                ssize_t n;
+                check_compact(p);
+                if (p->out_size - p->out_len < 65536) {
+                    p->out_size = p->out_len + 65536 * 2;
+                    p->out_buf = realloc(p->out_buf, p->out_size);
+                }
+                n = read(p->out_fd, p->out_buf + p->out_len,
+                        p->out_size - p->out_len);
+                if (n <= 0)
+                    out_eof[i] = 1;
+                else
+                    p->out_len += n;
+            }
+            if (in_eof && !p->in_len && p->in_fd >= 0) {
+                close(p->in_fd);
+                p->in_fd = -1;
+            }
+        }
+    }
+
+out:
+    free(prev);
+    for (int i = 0; i < 2; i++) {
+        kill(proc[i].pid, SIGKILL);
+        waitpid(proc[i].pid, NULL, 0);
+    }
+    return ret;
+}
+
+int check_run(struct machine *m)
+{
+    struct check_proc proc[2];
+    int ret;
+
+    ret = check_fork(m, &proc[0], "S-state");
+    if (ret)
+        return ret < 0 ? ret : machine_run(m, 0);
+
+    ret = check_fork(m, &proc[1], "fast");
+    if (ret) {
+        /* only one log, display output and -t/-A/-C/-H file */
+        close(proc[0].in_fd);
+        close(proc[0].out_fd);
+        log_flags = 0;
+        m->record = NULL;
+        m->latency = NULL;
+        m->trace = NULL;
+        m->profile = NULL;
+        m->coverage = NULL;
+        m->out = fopen("/dev/null", "w");
+        if (!m->out)
+            exit(2);
+        return ret < 0 ? ret : machine_run(m, 1);
+    }
+
+    /* a child may stop before reading all its input */
+    signal(SIGPIPE, SIG_IGN);
+    return check_parent(m, proc);
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2024 by Matthieu CASTET <castet.matthieu@free.fr>
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "emu.h"
+
+/**
+ * Merge coverage files (main -C) and print them as text.
+ */
+
+static void help(void)
+{
+    printf("covdump [-o merged_file] [-q] coverage_file...\n");
+    printf("-o file: save the merged coverage\n");
+    printf("-q: only print the summary\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct coverage *c = coverage_new();
+    const char *out = NULL;
+    int quiet = 0;
+    int opt;
+
+    if (!c)
+        return 1;
+    while ((opt = getopt(argc, argv, "o:q")) != -1) {
+        switch (opt) {
+        case 'o':
+            out = optarg;
+            break;
+        case 'q':
+            quiet = 1;
+            break;
+        default:
+            help();
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        help();
+        return 1;
+    }
+    for (int i = optind; i < argc; i++) {
+        if (coverage_load(c, argv[i])) {
+            printf("can't read coverage '%s'\n", argv[i]);
+            return 1;
+        }
+    }
+    if (quiet) {
+        printf("coverage : ");
+        coverage_summary(c, stdout);
+    }
+    else
+        coverage_text(c, stdout);
+    if (out && coverage_save(c, out)) {
+        printf("can't save coverage '%s'\n", out);
+        return 1;
+    }
+    free(c);
+    return 0;
+}
@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2024 by Matthieu CASTET <castet.matthieu@free.fr>
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "emu.h"
+
+/**
+ * Coverage : one bit per rom address (fetched) and per crom byte (read).
+ *
+ * The present words are also saved, so a file has the coverage
+ * percentage without the roms. Files are merged by or-ing all the
+ * bitmaps : the file of -C accumulates several runs, and covdump
+ * merge files of several runs.
+ *
+ * Runs merging in the same file at the same time (batch threads and
+ * forks) are serialized with flock() on the file, and the merged file
+ * is written aside then renamed : a reader never sees a partial file.
+ *
+ * file format :
+ *   "TI5XCOVR" uint32 version, uint32 COVERAGE_SIZE
+ *   struct coverage
+ */
+
+struct coverage *coverage_new(void)
+{
+    return calloc(1, sizeof(struct coverage));
+}
+
+/* set bits [start, end) */
+void coverage_set(uint8_t *bits, unsigned start, unsigned end)
+{
+    for (unsigned a = start; a < end && a < COVERAGE_SIZE; a++)
+        coverage_hit(bits, a);
+}
+
+/* or file in c. Return 1 if not a coverage file, -1 if it can't be opened */
+int coverage_load(struct coverage *c, const char *name)
+{
+    FILE *f = fopen(name, "rb");
+    struct coverage file;
+    char magic[8];
+    uint32_t version, size;
+    int ret = 0;
+
+    if (!f)
+        return -1;
+    if (fread(magic, sizeof(magic), 1, f) != 1 ||
+            memcmp(magic, COVERAGE_MAGIC, sizeof(magic)) ||
+            fread(&version, sizeof(version), 1, f) != 1 ||
+            version != COVERAGE_VERSION ||
+            fread(&size, sizeof(size), 1, f) != 1 ||
+            size != COVERAGE_SIZE ||
+            fread(&file, sizeof(file), 1, f) != 1)
+        ret = 1;
+    fclose(f);
+    if (ret)
+        return ret;
+
+    uint8_t *dst = (uint8_t *)c;
+    const uint8_t *src = (const uint8_t *)&file;
+    for (size_t i = 0; i < sizeof(file); i++)
+        dst[i] |= src[i];
+    return 0;
+}
+
+int coverage_save(const struct coverage *c, const char *name)
+{
+    FILE *f = fopen(name, "wb");
+    uint32_t version = COVERAGE_VERSION, size = COVERAGE_SIZE;
+    int ret = 0;
+
+    if (!f)
+        return 1;
+    ret |= fwrite(COVERAGE_MAGIC, 8, 1, f) != 1;
+    ret |= fwrite(&version, sizeof(version), 1, f) != 1;
+    ret |= fwrite(&size, sizeof(size), 1, f) != 1;
+    ret |= fwrite(c, sizeof(*c), 1, f) != 1;
+    if (fclose(f))
+        ret = 1;
+    return ret;
+}
+
+/* lock name (created if needed) : return the locked fd, -1 on error.
+ * The file may have been replaced (rename) while waiting for the lock,
+ * then lock the new one.
+ */
+static int coverage_lock(const char *name)
+{
+    while (1) {
+        struct stat locked, cur;
+        int fd = open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+        if (fd < 0)
+            return -1;
+        if (flock(fd, LOCK_EX) || fstat(fd, &locked)) {
+            close(fd);
+            return -1;
+        }
+        if (!stat(name, &cur) && cur.st_dev == locked.st_dev &&
+                cur.st_ino == locked.st_ino)
+            return fd;
+        close(fd);
+    }
+}
+
+/* or name in c, and save c in name. Return 0 on success */
+int coverage_merge(struct coverage *c, const char *name)
+{
+    struct stat st;
+    char *tmp;
+    int ret = 1;
+    int fd = coverage_lock(name);
+
+    if (fd < 0)
+        return 1;
+    tmp = malloc(strlen(name) + 32);
+    /* empty : just created */
+    if (tmp && !fstat(fd, &st) && (!st.st_size || !coverage_load(c, name))) {
+        sprintf(tmp, "%s.%d.tmp", name, (int)getpid());
+        ret = coverage_save(c, tmp);
+        if (!ret && rename(tmp, name))
+            ret = 1;
+        if (ret)
+            unlink(tmp);
+    }
+    free(tmp);
+    /* release the lock */
+    close(fd);
+    return ret;
+}
+
+static int bit(const uint8_t *bits, unsigned a)
+{
+    return (bits[a / 8] >> (a % 8)) & 1;
+}
+
+static void count(const uint8_t *have, const uint8_t *hit,
+        unsigned *num, unsigned *num_hit)
+{
+    *num = *num_hit = 0;
+    for (unsigned a = 0; a < COVERAGE_SIZE; a++) {
+        *num += bit(have, a);
+        *num_hit += bit(have, a) && bit(hit, a);
+    }
+}
+
+static void summary(const char *name, const uint8_t *have, const uint8_t *hit,
+        FILE *f)
+{
+    unsigned num, num_hit;
+
+    count(have, hit, &num, &num_hit);
+    if (num)
+        fprintf(f, "%s %u/%u (%.1f%%)", name, num_hit, num,
+                100.0 * num_hit / num);
+}
+
+void coverage_summary(const struct coverage *c, FILE *f)
+{
+    summary("rom", c->rom, c->rom_hit, f);
+    fprintf(f, " ");
+    summary("crom", c->crom, c->crom_hit, f);
+    fprintf(f, "\n");
+}
+
+/* ranges of present words, hit or not */
+static void ranges(const char *name, const uint8_t *have, const uint8_t *hit,
+        FILE *f)
+{
+    unsigned a = 0;
+
+    while (a < COVERAGE_SIZE) {
+        unsigned start = a;
+        int state;
+
+        if (!bit(have, a)) {
+            a++;
+            continue;
+        }
+        state = bit(hit, a);
+        while (a < COVERAGE_SIZE && bit(have, a) && bit(hit, a) == state)
+            a++;
+        fprintf(f, "%s %04X-%04X %5u %s\n", name, start, a - 1, a - start,
+                state ? "hit" : "miss");
+    }
+}
+
+void coverage_text(const struct coverage *c, FILE *f)
+{
+    fprintf(f, "coverage : ");
+    coverage_summary(c, f);
+    ranges("rom ", c->rom, c->rom_hit, f);
+    ranges("crom", c->crom, c->crom_hit, f);
+}
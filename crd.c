@@ -31,6 +31,15 @@ struct crd {
  */
  
 
+static const struct chip_irg crd_irg[] = {
+    {0xFFFF, 0x0A28},
+    {0xFFFF, 0x0A38},
+    {0xFFFF, 0x0A48},
+    {0xFFFF, 0x0A58},
+    {0xFFFF, 0x0AC8},
+    {0, 0}
+};
+
 static int crd_process(void *priv, struct bus *bus)
 {
     struct crd *crd = priv;
@@ -68,8 +77,8 @@ static int crd_process(void *priv, struct bus *bus)
             }
             case 0x0A48: /* crd off */
                 if (crd->pc)
-                        printf("crd read/write %d\n", crd->pc);
-                crd_clear_switch();
+                        fprintf(bus->machine->out, "crd read/write %d\n", crd->pc);
+                crd_clear_switch(bus);
                 if (crd->file && crd->pc) {
                         fseek(crd->file, 0, SEEK_SET);
                         fwrite(crd->data, 1, sizeof(crd->data), crd->file);
@@ -85,7 +94,35 @@ static int crd_process(void *priv, struct bus *bus)
     return 0;
 }
 
+static int crd_save(void *priv, FILE *f)
+{
+    struct crd *crd = priv;
+    int ret = 0;
+    ret |= SNAP_PUT(f, crd->pc);
+    ret |= SNAP_PUT(f, crd->data);
+    ret |= SNAP_PUT(f, crd->flags);
+    ret |= SNAP_PUT(f, crd->flags_delay);
+    return ret;
+}
+
+static int crd_restore(void *priv, FILE *f)
+{
+    struct crd *crd = priv;
+    int ret = 0;
+    ret |= SNAP_GET(f, crd->pc);
+    ret |= SNAP_GET(f, crd->data);
+    ret |= SNAP_GET(f, crd->flags);
+    ret |= SNAP_GET(f, crd->flags_delay);
+    return ret;
+}
 
+static void crd_destroy(void *priv)
+{
+    struct crd *crd = priv;
+    if (crd->file)
+        fclose(crd->file);
+    free(crd);
+}
 
 int crd_init(struct chip *chip, const char *name)
 {
@@ -110,5 +147,12 @@ int crd_init(struct chip *chip, const char *name)
 
     chip->priv = crd;
     chip->process = crd_process;
+    chip->destroy = crd_destroy;
+    chip->save = crd_save;
+    chip->restore = crd_restore;
+    chip->slots = SLOT(15, 1) | SLOT(15, 0);
+    chip->irg = crd_irg;
+    /* ext out at cycle 3 */
+    chip->irg_delay = 2;
     return 0;
 }
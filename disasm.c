@@ -195,9 +195,11 @@ static const char *no_op[16] = {
 #define FLAG_IO_WRITE 0x20
 #define FLAG_IO_WRITE_PREV 0x40
 
-static unsigned check_flags;
+/* disasm write on f. check : io sequence state between two calls */
+#undef DIS
+#define DIS(...) fprintf (f, __VA_ARGS__)
 
-void disasm (unsigned addr, unsigned opcode) {
+void disasm_file (FILE *f, unsigned *check, unsigned addr, unsigned opcode) {
     /* instruction are in patent US 3900722 */
     unsigned new_check_flags = 0;
 
@@ -262,7 +264,7 @@ void disasm (unsigned addr, unsigned opcode) {
                 DIS ("MOV\tR5,f%c[1..4]", 'A' + wait_arg);
               else if (wait_arg == 7) {
                 DIS ("PRT2_FUNC/RAM2_W");
-                check_flags &= ~FLAG_IO_WRITE_PREV;
+                *check &= ~FLAG_IO_WRITE_PREV;
                 new_check_flags |= FLG_IOW_EXPECTED;
               }
               else if (wait_arg == 9) {
@@ -276,14 +278,14 @@ void disasm (unsigned addr, unsigned opcode) {
               }
               else if (wait_arg == 8) {
                 DIS ("PRT2_CLEAR/RAM2_R");
-                check_flags &= ~FLAG_IO_WRITE_PREV;
+                *check &= ~FLAG_IO_WRITE_PREV;
                 new_check_flags |= FLG_IOR_EXPECTED;
               }
               else
                   DIS("MOV\tR5,f%c[1..4]\t;????", 'A' + wait_arg);
           } else if (wait_type == 0x0F) { //Register
               // STO/RCL
-              check_flags &= ~FLAG_IO_WRITE_PREV;
+              *check &= ~FLAG_IO_WRITE_PREV;
               if (opcode & 0x0010) {
                   DIS ("RCL %c", 'F' + ((opcode & 0xF0)>>5));
                   new_check_flags |= FLG_IOR_EXPECTED;
@@ -315,43 +317,49 @@ void disasm (unsigned addr, unsigned opcode) {
       DIS ("|#%s", N[(opcode>>8)&0x0F]);
 
     /* IO write. Do not ouput log, if there may be a write access (FLG_IOx_EXPECTED) */
-    if (sum[opcode&0x07][0] == 'I' && !(check_flags & (FLG_IOW_EXPECTED|FLG_IOx_EXPECTED))) {
+    if (sum[opcode&0x07][0] == 'I' && !(*check & (FLG_IOW_EXPECTED|FLG_IOx_EXPECTED))) {
         DIS("\t; output ignore (use R5/COND)");
         if (mask[(opcode>>8)&0x0F][0] == 'A')
             new_check_flags |= FLAG_IO_WRITE_PREV;
     }
     if (sum[opcode&0x07][0] == 'I')
-        check_flags |= FLAG_IO_WRITE;
+        *check |= FLAG_IO_WRITE;
     else
-        check_flags |= FLAG_IO_READ;
+        *check |= FLAG_IO_READ;
 
     break;
   }
 
-    if (check_flags & FLAG_IO_WRITE_PREV) {
+    if (*check & FLAG_IO_WRITE_PREV) {
             DIS("\t; unused IO.ALL write ????");
-            check_flags &= ~FLAG_IO_WRITE_PREV;
+            *check &= ~FLAG_IO_WRITE_PREV;
     }
 
-    if ((check_flags & FLG_IOR_EXPECTED) && !(check_flags & FLAG_IO_READ)) {
+    if ((*check & FLG_IOR_EXPECTED) && !(*check & FLAG_IO_READ)) {
         DIS("\t; ???? expected io read, but doing write !");
     }
-    if ((check_flags & FLG_IOW_EXPECTED) && !(check_flags & FLAG_IO_WRITE)) {
+    if ((*check & FLG_IOW_EXPECTED) && !(*check & FLAG_IO_WRITE)) {
         DIS("\t; ?? expected io write. Zero write !");
     }
-    check_flags &= ~FLG_IOR_EXPECTED;
-    check_flags &= ~FLG_IOx_EXPECTED;
-    if ((check_flags & FLG_IOWx_EXPECTED) == FLG_IOWx_EXPECTED) {
-        check_flags &= ~FLG_IOWx_EXPECTED;
-        check_flags |= FLG_IOx_EXPECTED;
-    } else if (check_flags & FLG_IOW_EXPECTED)
-        check_flags &= ~FLG_IOW_EXPECTED;
+    *check &= ~FLG_IOR_EXPECTED;
+    *check &= ~FLG_IOx_EXPECTED;
+    if ((*check & FLG_IOWx_EXPECTED) == FLG_IOWx_EXPECTED) {
+        *check &= ~FLG_IOWx_EXPECTED;
+        *check |= FLG_IOx_EXPECTED;
+    } else if (*check & FLG_IOW_EXPECTED)
+        *check &= ~FLG_IOW_EXPECTED;
 
-    check_flags &= ~(FLAG_IO_READ|FLAG_IO_WRITE);
+    *check &= ~(FLAG_IO_READ|FLAG_IO_WRITE);
 
     if (new_check_flags) {
-        if (check_flags)
-            DIS("\t; ???? too much check old=0x%x new=0x%x", check_flags, new_check_flags);
-        check_flags = new_check_flags;
+        if (*check)
+            DIS("\t; ???? too much check old=0x%x new=0x%x", *check, new_check_flags);
+        *check = new_check_flags;
     }
 }
+
+static unsigned check_flags;
+
+void disasm (unsigned addr, unsigned opcode) {
+    disasm_file (log_file, &check_flags, addr, opcode);
+}
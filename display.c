@@ -21,19 +21,20 @@
 #include <string.h>
 #include "emu.h"
 
-static struct {
+struct display {
     char out[30]; /* segment output */
     char out1[30]; /* final version of segment output */
     int pos;
-} disp;
+};
 
-char *display_debug(void)
+char *display_debug(struct machine *m)
 {
-    return disp.out1;
+    return m->display->out1;
 }
 
 static int display_process(void *priv, struct bus *bus)
 {
+    struct display *disp = priv;
     /* alu update on S0W and clear at S14W */
     if (bus->sstate == 0 && !bus->write) {
         /* 13 digits display
@@ -46,38 +47,45 @@ static int display_process(void *priv, struct bus *bus)
          */
         if (bus->dstate <= 13 && bus->dstate >= 1) {
             if (bus->dstate == 1 && bus->display_segH)
-                disp.out[0] = '-';
+                disp->out[0] = '-';
             if (bus->dstate == 2) {
                 if (bus->display_segH)
-                    disp.out[disp.pos++] = '-';
+                    disp->out[disp->pos++] = '-';
                 else
-                    disp.out[disp.pos++] = ' ';
+                    disp->out[disp->pos++] = ' ';
             }
             if (bus->dstate != 13)
-                disp.out[disp.pos++] = bus->display_digit;
+                disp->out[disp->pos++] = bus->display_digit;
             else
-                disp.out[disp.pos++] = ' ';
+                disp->out[disp->pos++] = ' ';
 
             /* not really seen in rom, but hw allow it */
             if (bus->dstate == 13 && bus->display_segH)
-                disp.out[0] = '-';
+                disp->out[0] = '-';
 
             if (bus->display_dpt && bus->dstate >= 3)
-                disp.out[disp.pos++] = '.';
+                disp->out[disp->pos++] = '.';
             else if (bus->display_dpt && bus->dstate == 1)
                 LOG("???? dpt at D1 ");
-            //LOG("\nSEG.%d='%c' (%s)\n", bus->dstate, bus->display_digit, disp.out);
+            //LOG("\nSEG.%d='%c' (%s)\n", bus->dstate, bus->display_digit, disp->out);
         }
         if (bus->dstate==0) {
-            disp.out[disp.pos + 2] = bus->idle ? ' ' : 'B';
-            if (memcmp(disp.out1, disp.out, sizeof(disp.out1))) {
-                LOG("\nDISP='%s'\n", disp.out);
-                printf(" \r%s", disp.out);
-                memcpy(disp.out1, disp.out, sizeof(disp.out1));
+            int changed;
+
+            disp->out[disp->pos + 2] = bus->idle ? ' ' : 'B';
+            changed = memcmp(disp->out1, disp->out, sizeof(disp->out1));
+            if (changed) {
+                LOG("\nDISP='%s'\n", disp->out);
+                fprintf(bus->machine->out, " \r%s", disp->out);
+                bus->machine->io++;
+                memcpy(disp->out1, disp->out, sizeof(disp->out1));
             }
-            //memset(disp.out, '\0', sizeof(disp.out));
-            memset(disp.out, ' ', sizeof(disp.out)-1);
-            disp.pos = 0;
+            if (bus->machine->latency)
+                latency_scan(bus->machine->latency, bus->machine, bus->idle,
+                        changed);
+            //memset(disp->out, '\0', sizeof(disp->out));
+            memset(disp->out, ' ', sizeof(disp->out)-1);
+            disp->pos = 0;
         }
     }
     return 0;
@@ -85,6 +93,7 @@ static int display_process(void *priv, struct bus *bus)
 
 static int display_process2(void *priv, struct bus *bus)
 {
+    struct display *disp = priv;
     /* alu update on S0W and clear at S14W */
     if (bus->sstate == 0 && !bus->write) {
         /* 12 digit connected to D13-D2
@@ -94,36 +103,43 @@ static int display_process2(void *priv, struct bus *bus)
             /* bus->display_segH is connected to C and D13
              */
             if (bus->dstate != 13)
-                disp.out[disp.pos++] = bus->display_digit;
+                disp->out[disp->pos++] = bus->display_digit;
             else {
                 if (bus->display_digit == '-') {
                     if (bus->display_segH)
-                        disp.out[disp.pos++] = 'E';
+                        disp->out[disp->pos++] = 'E';
                     else
-                        disp.out[disp.pos++] = '-';
+                        disp->out[disp->pos++] = '-';
                 }
                 else {
                     if (bus->display_segH)
-                        disp.out[disp.pos++] = 'C';
+                        disp->out[disp->pos++] = 'C';
                     else
-                        disp.out[disp.pos++] = ' ';
+                        disp->out[disp->pos++] = ' ';
                 }
             }
 
             if (bus->display_dpt)
-                disp.out[disp.pos++] = '.';
-            //LOG("\nSEG.%d='%c' (%s)\n", bus->dstate, bus->display_digit, disp.out);
+                disp->out[disp->pos++] = '.';
+            //LOG("\nSEG.%d='%c' (%s)\n", bus->dstate, bus->display_digit, disp->out);
         }
         if (bus->dstate==0) {
-            disp.out[disp.pos + 2] = bus->idle ? ' ' : 'B';
-            if (memcmp(disp.out1, disp.out, sizeof(disp.out1))) {
-                LOG("\nDISP='%s'\n", disp.out);
-                printf(" \r%s", disp.out);
-                memcpy(disp.out1, disp.out, sizeof(disp.out1));
+            int changed;
+
+            disp->out[disp->pos + 2] = bus->idle ? ' ' : 'B';
+            changed = memcmp(disp->out1, disp->out, sizeof(disp->out1));
+            if (changed) {
+                LOG("\nDISP='%s'\n", disp->out);
+                fprintf(bus->machine->out, " \r%s", disp->out);
+                bus->machine->io++;
+                memcpy(disp->out1, disp->out, sizeof(disp->out1));
             }
-            //memset(disp.out, '\0', sizeof(disp.out));
-            memset(disp.out, ' ', sizeof(disp.out)-1);
-            disp.pos = 0;
+            if (bus->machine->latency)
+                latency_scan(bus->machine->latency, bus->machine, bus->idle,
+                        changed);
+            //memset(disp->out, '\0', sizeof(disp->out));
+            memset(disp->out, ' ', sizeof(disp->out)-1);
+            disp->pos = 0;
         }
     }
     return 0;
@@ -146,30 +162,69 @@ static int displaysr60_process(void *priv, struct bus *bus)
     return 0;
 }
 
-void display_ext(const char *line)
+void display_ext(struct bus *bus, const char *line)
 {
-    strcpy(disp.out, line);
-    if (memcmp(disp.out1, disp.out, sizeof(disp.out1))) {
-        LOG("\nDISP='%s'\n", disp.out);
-        printf(" \r%s", disp.out);
-        memcpy(disp.out1, disp.out, sizeof(disp.out1));
+    struct display *disp = bus->machine->display;
+
+    strcpy(disp->out, line);
+    if (memcmp(disp->out1, disp->out, sizeof(disp->out1))) {
+        LOG("\nDISP='%s'\n", disp->out);
+        fprintf(bus->machine->out, " \r%s", disp->out);
+        bus->machine->io++;
+        memcpy(disp->out1, disp->out, sizeof(disp->out1));
     }
 }
 
-void display_print(const char *line)
+void display_print(struct bus *bus, const char *line)
+{
+    struct display *disp = bus->machine->display;
+
+    bus->machine->io++;
+    fprintf(bus->machine->out, "|      %.20s\n", line);
+    fprintf(bus->machine->out, "\r%s", disp->out);
+    if (bus->machine->tape)
+        fprintf(bus->machine->tape, "%.20s\n", line);
+}
+
+void display_dbgprint(struct bus *bus, const char *line)
+{
+    struct display *disp = bus->machine->display;
+
+    bus->machine->io++;
+    fprintf(bus->machine->out, "|d     %.13s %s\n", disp->out1, line);
+    fprintf(bus->machine->out, "\r%s", disp->out);
+}
+
+static int display_dump_state(void *priv, struct bus *bus, FILE *f)
+{
+    struct display *disp = priv;
+    fprintf(f, "DISP='%s'\n", disp->out1);
+    return 0;
+}
+
+static int display_save(void *priv, FILE *f)
 {
-    printf("|      %.20s\n", line);
-    printf("\r%s", disp.out);
+    return snap_put(f, priv, sizeof(struct display));
 }
 
-void display_dbgprint(const char *line)
+static int display_restore(void *priv, FILE *f)
 {
-    printf("|d     %.13s %s\n", disp.out1, line);
-    printf("\r%s", disp.out);
+    return snap_get(f, priv, sizeof(struct display));
 }
 
-int display_init(struct chip *chip, const char *name)
+int display_init(struct machine *m, struct chip *chip, const char *name)
 {
+    struct display *disp = calloc(1, sizeof(*disp));
+
+    if (!disp)
+        return -1;
+    m->display = disp;
+    chip->priv = disp;
+    /* alu output digit at S0W */
+    chip->slots = SLOT(0, 0);
+    chip->dump_state = display_dump_state;
+    chip->save = display_save;
+    chip->restore = display_restore;
     if (name && !strcmp(name, "sr60")) {
         chip->process = displaysr60_process;
     }
@@ -180,6 +235,8 @@ int display_init(struct chip *chip, const char *name)
     }
     else
         chip->process = display_process;
+    /* nothing else to do while the alu holds the bus */
+    chip->hold = chip->process;
 
     return 0;
 }
@@ -25,13 +25,65 @@
 
 //#define TEST_MODE
 
+/* bus slot : process is called at S-state s, write (1) or read (0) phase */
+#define SLOT(s, w)  (1u << ((s) * 2 + !!(w)))
+#define SLOT_ALL    0xFFFFFFFFu
+
+/* instruction decoded by a chip : (irg & mask) == value */
+struct chip_irg {
+    uint16_t mask;
+    uint16_t value;
+};
+
+struct coverage;
+
 struct chip {
     int (*process)(void *priv, struct bus *bus);
     void *priv;
-    //int (*dump_state)(void *priv, struct bus *bus, FILE *f);
+    /* text dump of chip state, used by lockstep check */
+    int (*dump_state)(void *priv, struct bus *bus, FILE *f);
     void (*destroy)(void *priv);
+    /* slots where process need to be called (SLOT mask).
+     * 0 is the same as SLOT_ALL
+     */
+    uint32_t slots;
+    /* instructions decoded at S15R, terminated by a 0 mask.
+     * If set, process is only called for the cycle of a matching
+     * instruction and the irg_delay following cycles (time to
+     * finish io). NULL : process is called on every cycle.
+     */
+    const struct chip_irg *irg;
+    int irg_delay;
+    /* instruction level model used by the fast engine. Called with
+     * sstate 0 for all S0..S14 slots (write then read phase), then
+     * with sstate 15. NULL : process is used, it is only valid
+     * for chips using S0 and S15 slots.
+     */
+    int (*step)(void *priv, struct bus *bus);
+    /* snapshot of the chip state changed by running, see snapshot.c.
+     * NULL : nothing to save.
+     */
+    int (*save)(void *priv, FILE *f);
+    int (*restore)(void *priv, FILE *f);
+    /* mark the rom/crom words of the chip in coverage, see coverage.c.
+     * NULL : no rom.
+     */
+    void (*coverage)(void *priv, struct coverage *c);
+    /* fast engine : cycle where the alu repeats an instruction holding
+     * the bus (EXT_HOLD), see run_hold. Called with sstate 0 then 15
+     * (read phase). The alu return 1 if the instruction stops holding,
+     * the cycle is then run normally.
+     * NULL : nothing to do (rom address doesn't change, routed chips
+     * are not waiting for the instruction).
+     */
+    int (*hold)(void *priv, struct bus *bus);
 };
 
+int snap_put(FILE *f, const void *data, size_t size);
+int snap_get(FILE *f, void *data, size_t size);
+#define SNAP_PUT(f, x) snap_put(f, &(x), sizeof(x))
+#define SNAP_GET(f, x) snap_get(f, &(x), sizeof(x))
+
 
 // ====================================
 // Log control
@@ -45,6 +97,11 @@ extern unsigned log_flags;
 #define	DIS(...)	fprintf (log_file, __VA_ARGS__)
 #define	LOG(...)	do { if (log_flags & LOG_SHORT) fprintf (log_file, __VA_ARGS__); } while (0)
 
+/* log_file written by a thread, see log.c */
+int log_open(const char *name, int drop);
+void log_close(void);
+void log_signal_flush(void);
+
 /* hw options */
 enum hw {
     HW_PRINTER = 1,
@@ -58,9 +115,372 @@ enum printer_type {
 };
 
 void disasm (unsigned addr, unsigned opcode);
+void disasm_file (FILE *f, unsigned *check, unsigned addr, unsigned opcode);
+
+
+/* binary trace, see trace.c */
+#define TRACE_MAGIC "TI5XTRAC"
+#define TRACE_VERSION 1
+
+struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t rec_size;
+    /* records written since start, and saved in file */
+    uint64_t count;
+    uint64_t num;
+};
+
+/* alu state before an instruction */
+struct trace_rec {
+    uint64_t cycle;
+    uint64_t A, B, C, D, E;
+    uint64_t Sin, Sout;
+    uint16_t addr, opcode;
+    uint16_t state;
+    uint16_t fA, fB, KR, SR, EXT;
+    uint8_t digit, R5;
+    uint8_t pad[6];
+};
+
+/* trace_rec.state */
+#define TRACE_COND 0x0001
+#define TRACE_IDLE 0x0002
+#define TRACE_HOLD 0x0004
+
+struct trace {
+    struct trace_rec *rec;
+    /* number of records - 1, a power of 2 */
+    uint64_t mask;
+    uint64_t count;
+};
+
+struct trace *trace_new(unsigned long long size);
+void trace_free(struct trace *t);
+int trace_save(struct trace *t, const char *name);
+
+static inline struct trace_rec *trace_next(struct trace *t)
+{
+    return &t->rec[t->count++ & t->mask];
+}
+
+/* rom execution profile, see profile.c */
+#define PROFILE_SIZE 0x2000
+
+struct profile {
+    /* per rom address : fetches, host time until next fetch (ns) */
+    uint64_t count[PROFILE_SIZE];
+    uint64_t ns[PROFILE_SIZE];
+    uint16_t opcode[PROFILE_SIZE];
+    unsigned last;
+    uint64_t last_ns;
+};
+
+struct profile *profile_new(void);
+int profile_save(struct profile *p, const char *name);
+uint64_t profile_now(void);
+
+/* instruction fetched by a rom */
+static inline void profile_hit(struct profile *p, unsigned addr, unsigned opcode)
+{
+    uint64_t now = profile_now();
+
+    addr &= PROFILE_SIZE - 1;
+    p->ns[p->last] += now - p->last_ns;
+    p->last_ns = now;
+    p->last = addr;
+    p->count[addr]++;
+    p->opcode[addr] = opcode;
+}
+
+/* don't count time waiting for the user */
+static inline void profile_idle(struct profile *p)
+{
+    p->last_ns = profile_now();
+}
+
+/* rom and crom coverage, see coverage.c */
+#define COVERAGE_MAGIC "TI5XCOVR"
+#define COVERAGE_VERSION 1
+#define COVERAGE_SIZE 0x2000
+
+struct coverage {
+    /* one bit per rom address / crom byte : present, executed or read */
+    uint8_t rom[COVERAGE_SIZE / 8];
+    uint8_t rom_hit[COVERAGE_SIZE / 8];
+    uint8_t crom[COVERAGE_SIZE / 8];
+    uint8_t crom_hit[COVERAGE_SIZE / 8];
+};
+
+struct coverage *coverage_new(void);
+void coverage_set(uint8_t *bits, unsigned start, unsigned end);
+int coverage_load(struct coverage *c, const char *name);
+int coverage_save(const struct coverage *c, const char *name);
+int coverage_merge(struct coverage *c, const char *name);
+void coverage_text(const struct coverage *c, FILE *f);
+void coverage_summary(const struct coverage *c, FILE *f);
+
+static inline void coverage_hit(uint8_t *bits, unsigned addr)
+{
+    addr &= COVERAGE_SIZE - 1;
+    bits[addr / 8] |= 1 << (addr % 8);
+}
+
+/* key latency histogram, see latency.c */
+#define LATENCY_KEYS 128
+/* log2 buckets : 0, then [2^(b-1), 2^b - 1] */
+#define LATENCY_BUCKETS 65
+
+struct latency_key {
+    uint64_t count, lost;
+    uint64_t cycles, cycles_min, cycles_max;
+    uint64_t ns, ns_min, ns_max;
+    uint64_t hist_cycles[LATENCY_BUCKETS];
+    uint64_t hist_ns[LATENCY_BUCKETS];
+    /* keyboard character */
+    int c;
+};
+
+struct latency {
+    const char *model;
+    const char *name;
+    struct latency_key keys[LATENCY_KEYS];
+    /* key being measured, -1 : none */
+    int code;
+    unsigned long long start_cycle;
+    uint64_t start_ns;
+    /* rom busy or display changed since the press */
+    int reacted;
+    /* last SIGUSR1 dump generation written */
+    int dump;
+};
+
+struct latency *latency_new(const char *model, const char *name);
+void latency_press(struct latency *l, struct machine *m, int code, int c);
+void latency_scan(struct latency *l, struct machine *m, int idle, int changed);
+int latency_save(struct latency *l, const char *job);
+
+/* key input queue, see input.c */
+#define INPUT_SIZE 256
+
+struct input {
+    unsigned char buf[INPUT_SIZE];
+    unsigned pos, len;
+    /* fd is a terminal, -1 : not known yet */
+    int tty;
+    /* parking on a terminal, -1 : not created. wake : slot in input.c */
+    int epfd, timer, wake;
+};
+
+void input_setup(int fd);
+int input_get(struct input *in, int fd, unsigned char *c, int block,
+        unsigned long long deadline);
+int input_is_tty(struct input *in, int fd);
+void input_wake(void);
+void input_free(struct input *in);
+
+/* key script (-K) and key recording (-Y), see script.c */
+#define SCRIPT_READY 0
+#define SCRIPT_AT 1
+#define SCRIPT_AFTER 2
+
+struct script_key {
+    /* SCRIPT_AT : cycle, SCRIPT_AFTER : cycles after the previous key */
+    unsigned long long cycle;
+    int when;
+    unsigned char c;
+};
+
+struct script {
+    struct script_key *keys;
+    unsigned num, size, pos;
+    /* cycle of the previous key */
+    unsigned long long last;
+    int started;
+};
+
+struct script_rec {
+    FILE *f;
+    /* keys on the open "-" line, 0 : none */
+    int ready;
+};
+
+struct script *script_load(const char *name);
+void script_free(struct script *s);
+int script_get(struct script *s, unsigned long long cycle, int block,
+        unsigned char *c);
+struct script_rec *script_rec_open(const char *name);
+void script_rec(struct script_rec *r, unsigned long long cycle, int block,
+        unsigned char c);
+int script_rec_close(struct script_rec *r);
+
+/* real time pacing, see pace.c */
+struct pace {
+    /* host ns per cycle */
+    double cycle_ns;
+    /* emulated time in cycles, an idle cycle counts 4 */
+    unsigned long long time;
+    /* time of the next sleep, cycles between sleeps */
+    unsigned long long next;
+    unsigned long long step;
+    /* host time of start_time, 0 : not started */
+    unsigned long long start_ns;
+    unsigned long long start_time;
+};
+
+struct pace *pace_new(double speed);
+void pace_wait(struct pace *p);
+unsigned long long pace_idle_ns(const struct pace *p, unsigned long long cycles);
+unsigned long long pace_idle(struct pace *p, unsigned long long ns,
+        unsigned long long max);
+
+/* end of an instruction cycle */
+static inline void pace_cycle(struct pace *p, int idle)
+{
+    p->time += idle ? 4 : 1;
+    if (p->time >= p->next)
+        pace_wait(p);
+}
+
+/* steady state : the fast engine looks for a machine state repeating
+ * without input/output, and jumps whole periods toward cycle_max.
+ * See steady.c
+ */
+struct steady {
+    /* reference state, taken at a scan start (dstate 15). NULL : none */
+    char *image;
+    size_t len;
+    int addr;
+    unsigned long long start;
+    /* no reference before this cycle */
+    unsigned long long next;
+    /* m->io at start, a routed chip ran since start */
+    unsigned long long io;
+    int routed;
+    /* pace time at start */
+    unsigned long long pace_time;
+    /* Brent cycle detection, in scans : the reference moves after power
+     * scans, lam scans since the reference. No compare before min_lam.
+     */
+    unsigned power, lam, min_lam;
+};
+
+/* at most 64 chips, see irg_route */
+#define CHIPS_NUM_MAX 55
+#define IRG_NUM 0x2000
+
+/* one calculator : all its state, no global.
+ * Several machines can run in the same process.
+ */
+struct machine {
+    struct chip chips[CHIPS_NUM_MAX];
+    struct bus bus;
+
+    /* chips (bit mask) to call for each S-state/phase.
+     * Chips are called in chips[] order.
+     */
+    uint64_t slots[16][2];
+    /* chips (bit mask) decoding each 13 bits instruction */
+    uint64_t irg_route[IRG_NUM];
+    /* chips using irg_route, and the ones currently active */
+    uint64_t irg_routed;
+    uint64_t irg_active;
+    int irg_left[CHIPS_NUM_MAX];
+    /* fast engine : function called for each chip */
+    int (*step_fn[CHIPS_NUM_MAX])(void *priv, struct bus *bus);
+    /* fast engine : chips with a hold function */
+    uint64_t hold_chips;
+
+    /* chips used by other chips */
+    struct display *display;
+    struct key *key;
+
+    /* instruction cycles since start, stop at cycle_max (0 : never) */
+    unsigned long long cycle;
+    unsigned long long cycle_max;
+
+    /* key input and display/printer output */
+    int in_fd;
+    FILE *out;
+    /* keys from a script instead of in_fd, and recorded keys */
+    struct script *script;
+    struct script_rec *record;
+    /* -I : read keys only when the calculator is ready, see key.c */
+    int key_inject;
+    /* number of key reads and display/printer outputs, see steady */
+    unsigned long long io;
+    struct steady steady;
+    /* if set, printer lines are also written here */
+    FILE *tape;
+    /* lockstep check record output, see check.c */
+    FILE *check_out;
+
+    /* binary trace of the last instructions, saved at the end of run */
+    struct trace *trace;
+    const char *trace_name;
+
+    /* rom profile, saved at the end of run */
+    struct profile *profile;
+    const char *profile_name;
+
+    /* key latency (-H), saved at the end of run */
+    struct latency *latency;
+    /* batch job name, NULL : not in a batch */
+    const char *job;
+
+    /* coverage, merged in file at the end of run */
+    struct coverage *coverage;
+    const char *coverage_name;
+
+    /* real time pacing, NULL : as fast as possible */
+    struct pace *pace;
+
+    /* snapshot to load at start, and to save at first blocking key read */
+    const char *snap_load;
+    const char *snap_save;
+
+    /* run/run_fast resume a started machine */
+    int started;
+    /* stop the engine (RUN_KEY_WAIT) instead of the next blocking key read.
+     * The key is read at next scan.
+     */
+    int stop_key_wait;
+    int key_wait;
+};
+
+/* run/run_fast return value, see stop_key_wait */
+#define RUN_KEY_WAIT 0x100
+/* returned by the key chip when the keys are over : a normal end of run,
+ * machine_run returns 0
+ */
+#define RUN_END_OF_INPUT 0x101
+
+struct machine *machine_new(void);
+void machine_free(struct machine *m);
+int machine_setup(struct machine *m, int argc, char *argv[],
+        int disasm, int disasm_crom);
+int run(struct machine *m);
+int run_fast(struct machine *m);
+int machine_run(struct machine *m, int fast);
+
+/* lockstep check of the S-state engine against the fast engine */
+int check_run(struct machine *m);
+void check_cycle(struct machine *m);
+
+int snapshot_save(struct machine *m, const char *name);
+int snapshot_load(struct machine *m, const char *name);
+int snapshot_take(struct machine *m);
+char *snapshot_state(struct machine *m, size_t *len);
+
+void steady_scan(struct machine *m);
+void steady_reset(struct steady *s);
 
+/* run a list of jobs on a thread pool, see batch.c */
+int batch_run(const char *name, int threads, int fast,
+        unsigned long long cycle_max, int pool);
 
 int alu_init(struct chip *chip);
+int alu_init_notrace(struct chip *chip);
 
 
 int brom_init(struct chip *chip, const char *name, int disasm);
@@ -70,11 +490,12 @@ int load_dumpK (unsigned char buf[][16], int buf_len, const char *name, int *bas
 int load_dump8 (unsigned char *buf, int buf_len, const char *name);
 
 
-int display_init(struct chip *chip, const char *name);
-void display_print(const char *line);
-void display_dbgprint(const char *line);
-void display_ext(const char *line);
-int key_init(struct chip *chip, const char *name, enum hw hw_opt);
+int display_init(struct machine *m, struct chip *chip, const char *name);
+char *display_debug(struct machine *m);
+void display_print(struct bus *bus, const char *line);
+void display_dbgprint(struct bus *bus, const char *line);
+void display_ext(struct bus *bus, const char *line);
+int key_init(struct machine *m, struct chip *chip, const char *name, enum hw hw_opt);
 
 int scom_init(struct chip *chip, const char *name);
 int ram_init(struct chip *chip, int addr);
@@ -87,4 +508,4 @@ extern const char libtoken[100][8];
 int aux_init(struct chip *chip, const char *name);
 
 int crd_init(struct chip *chip, const char *name);
-int crd_clear_switch(void);
+int crd_clear_switch(struct bus *bus);
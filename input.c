@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2024 by Matthieu CASTET <castet.matthieu@free.fr>
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include <stdlib.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include "emu.h"
+
+/**
+ * Key input queue.
+ *
+ * The terminal is set once, at start : no line buffering, no echo and
+ * read() returns what is available without waiting (VMIN=0, VTIME=0).
+ * The bytes are read in a queue, and the key chip takes them one by
+ * one : a key poll with an empty queue costs one read().
+ *
+ * A blocking read (the calculator is idle, waiting for a key) parks the
+ * emulator in epoll_wait() on the terminal, its wake eventfd (written
+ * by input_wake, from a signal handler) and a timerfd (deadline, see
+ * key.c) : an idle calculator costs no host cpu.
+ * Each parked input has its own wake eventfd, so one input_wake reaches
+ * every machine of a batch.
+ *
+ * Files and pipes (key scripts, batch, -X) are read in the queue too,
+ * but any read waits for the next byte : a script gives the same run
+ * whatever the timing.
+ */
+
+/* terminal settings before input_setup, restored at exit */
+static struct termios input_saved;
+static int input_tty_fd = -1;
+/* process that changed the terminal : forks don't restore it */
+static pid_t input_pid;
+
+static void input_restore(void)
+{
+    if (getpid() == input_pid)
+        tcsetattr(input_tty_fd, TCSANOW, &input_saved);
+}
+
+/* set the terminal once, shared by all machines reading it */
+void input_setup(int fd)
+{
+    struct termios t;
+
+    if (input_tty_fd >= 0 || !isatty(fd) || tcgetattr(fd, &input_saved))
+        return;
+    t = input_saved;
+    t.c_lflag &= ~(ICANON | ECHO);
+    t.c_cc[VMIN] = 0;
+    t.c_cc[VTIME] = 0;
+    if (tcsetattr(fd, TCSANOW, &t))
+        return;
+    input_tty_fd = fd;
+    input_pid = getpid();
+    atexit(input_restore);
+}
+
+/* wake eventfds, taken by input_park_init and given back by input_free.
+ * They are never closed : input_wake may run in a signal handler while
+ * another thread frees its input, and must not write to a reused fd.
+ */
+#define INPUT_WAKES 1024
+
+static volatile int input_wakes[INPUT_WAKES];
+static volatile sig_atomic_t input_wakes_busy[INPUT_WAKES];
+static volatile sig_atomic_t input_wakes_count;
+static pthread_mutex_t input_wakes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* wakes the parked machines, async signal safe */
+void input_wake(void)
+{
+    uint64_t one = 1;
+
+    for (int i = 0; i < input_wakes_count; i++) {
+        if (input_wakes_busy[i] &&
+                write(input_wakes[i], &one, sizeof(one)) < 0)
+            continue;
+    }
+}
+
+/* a free wake slot, -1 if none */
+static int input_wake_get(void)
+{
+    uint64_t count;
+    int i;
+
+    pthread_mutex_lock(&input_wakes_lock);
+    for (i = 0; i < input_wakes_count; i++)
+        if (!input_wakes_busy[i])
+            break;
+    if (i == input_wakes_count) {
+        int fd = -1;
+
+        if (i < INPUT_WAKES)
+            fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd < 0) {
+            pthread_mutex_unlock(&input_wakes_lock);
+            return -1;
+        }
+        input_wakes[i] = fd;
+        input_wakes_count = i + 1;
+    }
+    /* drop a wake for the previous user */
+    if (read(input_wakes[i], &count, sizeof(count)) < 0)
+        count = 0;
+    input_wakes_busy[i] = 1;
+    pthread_mutex_unlock(&input_wakes_lock);
+    return i;
+}
+
+static void input_wake_put(int i)
+{
+    pthread_mutex_lock(&input_wakes_lock);
+    input_wakes_busy[i] = 0;
+    pthread_mutex_unlock(&input_wakes_lock);
+}
+
+static int input_watch(int epfd, int fd)
+{
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static int input_park_init(struct input *in, int fd)
+{
+    in->wake = input_wake_get();
+    in->epfd = epoll_create1(EPOLL_CLOEXEC);
+    in->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (in->wake < 0 || in->epfd < 0 || in->timer < 0 ||
+            input_watch(in->epfd, fd) ||
+            input_watch(in->epfd, input_wakes[in->wake]) ||
+            input_watch(in->epfd, in->timer)) {
+        input_free(in);
+        return 1;
+    }
+    return 0;
+}
+
+/* input_park without epoll (no wake slot or fd left) : input_wake
+ * doesn't reach it, only the deadline and signals
+ */
+static int input_poll(int fd, unsigned long long deadline)
+{
+    struct pollfd p = { .fd = fd, .events = POLLIN };
+    int timeout = -1;
+
+    if (deadline) {
+        unsigned long long now = profile_now();
+        unsigned long long ms = now < deadline ?
+            (deadline - now + 999999) / 1000000 : 0;
+
+        timeout = ms < INT_MAX ? ms : INT_MAX;
+    }
+    return poll(&p, 1, timeout) > 0;
+}
+
+/* wait until fd is readable (return 1), input_wake, a signal or the
+ * deadline (CLOCK_MONOTONIC ns, 0 : none)
+ */
+static int input_park(struct input *in, int fd, unsigned long long deadline)
+{
+    struct itimerspec t = {
+        .it_value.tv_sec = deadline / 1000000000ULL,
+        .it_value.tv_nsec = deadline % 1000000000ULL,
+    };
+    struct epoll_event ev[3];
+    uint64_t count;
+    int ready = 0;
+    int n;
+
+    if ((in->epfd < 0 && input_park_init(in, fd)) ||
+            timerfd_settime(in->timer, TFD_TIMER_ABSTIME, &t, NULL))
+        return input_poll(fd, deadline);
+    n = epoll_wait(in->epfd, ev, 3, -1);
+    for (int i = 0; i < n; i++) {
+        if (ev[i].data.fd == fd)
+            ready = 1;
+        else if (read(ev[i].data.fd, &count, sizeof(count)) < 0)
+            continue;
+    }
+    return ready;
+}
+
+void input_free(struct input *in)
+{
+    if (in->epfd >= 0)
+        close(in->epfd);
+    if (in->timer >= 0)
+        close(in->timer);
+    if (in->wake >= 0)
+        input_wake_put(in->wake);
+    in->epfd = in->timer = in->wake = -1;
+}
+
+int input_is_tty(struct input *in, int fd)
+{
+    if (in->tty < 0)
+        in->tty = isatty(fd);
+    return in->tty;
+}
+
+/* next byte in c : return 1, 0 if none (!block, or woken/deadline while
+ * waiting on a terminal), -1 at end of input.
+ * fd may be replaced (dup2) before the first read, see check.c
+ */
+int input_get(struct input *in, int fd, unsigned char *c, int block,
+        unsigned long long deadline)
+{
+    if (in->pos == in->len) {
+        ssize_t n;
+
+        if (input_is_tty(in, fd) && block &&
+                !input_park(in, fd, deadline))
+            return 0;
+        n = read(fd, in->buf, sizeof(in->buf));
+        if (n <= 0)
+            return block ? -1 : 0;
+        in->pos = 0;
+        in->len = n;
+    }
+    *c = in->buf[in->pos++];
+    return 1;
+}
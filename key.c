@@ -18,12 +18,8 @@
  *
  */
 
-//#define KEEP_RUN
-
-#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <termios.h>
 #include <ctype.h>
 #include <string.h>
 
@@ -39,7 +35,7 @@ struct keymap {
         unsigned char dummy;
 };
 
-static struct {
+struct key {
   unsigned char key[16];
   const struct keymap *keymap;
 
@@ -58,18 +54,17 @@ static struct {
 
   int keyboardidle;
 
-  // CPU cycle counter (used to simulate real CPU frequency)
-  unsigned cycle;
-  long long tick;
-  unsigned ex_cnt;
+  /* '{' debug key : next key code */
+  unsigned char debug_code;
+
+  /* -I : no key read while busy, and the release ends when the rom is
+   * back in its key wait loop : the scan at wait_addr (-1 : unknown)
+   */
+  int inject;
+  int wait_addr;
 
-} cpu;
-// 455kHz / 2 / 16 = 14219
-// 20ms ~ 284.375 instructions
-// 50ms ~ 710.9375 instructions
-#define	CPU_FREQ	455000	//[Hz]
-#define	EMUL_TICK	20	//[ms]
-#define	EMUL_CYCLE	((EMUL_TICK * CPU_FREQ) / 2 / 16 / 1000)
+  struct input input;
+};
 
 
 static const struct keymap key_table_ti58[] = {
@@ -297,24 +292,36 @@ static const char *key_help_sr50 =
       "----------\n"
       "RAD=R\n";
 
-static struct termios new_settings, new_settings_scan;
-static struct termios stored_settings;
 
-static unsigned long long GetTickCount (void)
+/* next key from the key script or the input, recorded with -Y */
+static int key_input(struct key *key, struct bus *bus, unsigned char *c,
+        int block)
 {
-	struct timespec tp;
-
-	clock_gettime(CLOCK_MONOTONIC, &tp);
-
-	return tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
-}
+    struct machine *m = bus->machine;
+    int ret;
+
+    if (m->script)
+        ret = script_get(m->script, m->cycle, block, c);
+    else if (block && m->pace && input_is_tty(&key->input, m->in_fd)) {
+        /* -x : the calculator runs its idle loop while the emulator is
+         * parked, the cycles are added when it resumes. With -n, the
+         * wait ends when cycle_max is reached.
+         */
+        unsigned long long left = !m->cycle_max ? ~0ULL :
+            m->cycle_max > m->cycle ? m->cycle_max - 1 - m->cycle : 0;
+        unsigned long long start = profile_now();
 
-static void Sleep(unsigned long long delay)
-{
-	usleep(delay*1000);
+        ret = input_get(&key->input, m->in_fd, c, block, m->cycle_max ?
+                start + pace_idle_ns(m->pace, left) : 0);
+        m->cycle += pace_idle(m->pace, profile_now() - start, left);
+    }
+    else
+        ret = input_get(&key->input, m->in_fd, c, block, 0);
+    if (ret == 1 && m->record)
+        script_rec(m->record, m->cycle, block, *c);
+    return ret;
 }
 
-
 /*
  * SR50 : 2 scan with key press, 1(2*) scan no key (* if cond is unset, there will be one more no key loop)
  * SR50.1 : 2 scan with key press, 2(3*) scan no key
@@ -324,78 +331,80 @@ static void Sleep(unsigned long long delay)
  * SR52/56 ti5x : 2 scan with key press, 2(3*) scan no key
  *
  * */
-static int key_read2(struct bus *bus, int block, int scan)
+static int key_read2(struct key *key, struct bus *bus, int block, int scan)
 {
-
     unsigned char AsciiChar = 0;
     int size;
 
+    bus->machine->io++;
     if (!block) {
-        //printf("nblk read %d\n", cpu.key_count);
+        //printf("nblk read %d\n", key->key_count);
         /* not blocking read */
-        tcsetattr(0, TCSANOW, &new_settings);
-        int ret = read(0, &AsciiChar, 1);
-        tcsetattr(0, TCSANOW, &new_settings_scan);
-        if (ret == 0)
+        if (key_input(key, bus, &AsciiChar, 0) <= 0)
             return 0;
     }
     else {
-        //printf("blk read %d\n", cpu.key_count);
+        //printf("blk read %d\n", key->key_count);
         /* blocking read */
+        if (bus->machine->stop_key_wait) {
+            /* waiting for a key : stop at the end of this cycle,
+             * the key is read on next scan
+             */
+            bus->machine->stop_key_wait = 0;
+            bus->machine->key_wait = 1;
+            return 0;
+        }
         LOG("key block\n");
-#if 1
-        int ret = read(0, &AsciiChar, 1);
+        int ret = key_input(key, bus, &AsciiChar, 1);
+        if (bus->machine->profile)
+            profile_idle(bus->machine->profile);
         if (ret != 1) {
-            return -1;
+            /* end of input, or script key not due yet */
+            return ret;
         }
-#else
-        Sleep(20);
-        tcsetattr(0, TCSANOW, &new_settings);
-        int ret = read(0, &AsciiChar, 1);
-        tcsetattr(0, TCSANOW, &new_settings_scan);
-        if (ret == 0)
-            return 0;
-#endif
+        key->wait_addr = bus->addr;
 #if 1
         if (AsciiChar == '{') {
-            static char c = 0;
-            printf("\nkey=0x%x\n", c);
-            cpu.key_count = cpu.key_press_cycle;
-            cpu.key_code = c++;
-            //if ((c & 0xF) == 0xF)
-            //    c++;
+            fprintf(bus->machine->out, "\nkey=0x%x\n", key->debug_code);
+            key->key_count = key->key_press_cycle;
+            key->key_code = key->debug_code++;
+            //if ((key->debug_code & 0xF) == 0xF)
+            //    key->debug_code++;
             /* skip busy */
-            if (c == 0x40)
-                c = 0x50;
-            if (c == 0x70)
-                c = 0;
+            if (key->debug_code == 0x40)
+                key->debug_code = 0x50;
+            if (key->debug_code == 0x70)
+                key->debug_code = 0;
             return 0;
         }
         if (AsciiChar == '[') {
-                cpu.key_count = 0;
+                key->key_count = 0;
             return 0;
         }
 #endif
     }
-    for (size = 0; cpu.keymap[size].ascii; size++) {
-        if (cpu.keymap[size].ascii && cpu.keymap[size].ascii == AsciiChar) {
+    for (size = 0; key->keymap[size].ascii; size++) {
+        if (key->keymap[size].ascii && key->keymap[size].ascii == AsciiChar) {
             if (log_flags & LOG_DEBUG)
-                LOG ("{K=%02X}\n", cpu.keymap[size].key_code);
+                LOG ("{K=%02X}\n", key->keymap[size].key_code);
             LOG("r.1=%c", AsciiChar);
-            if (!(cpu.keymap[size].flags & KEY_ONOFF)) {
-                //cpu.key[cpu.keymap[size].key_code & 0x0F] |= 1 << ((cpu.keymap[size].key_code >> 4) & 0x07);
+            if (!(key->keymap[size].flags & KEY_ONOFF)) {
+                if (bus->machine->latency)
+                    latency_press(bus->machine->latency, bus->machine,
+                            key->keymap[size].key_code, AsciiChar);
+                //key->key[key->keymap[size].key_code & 0x0F] |= 1 << ((key->keymap[size].key_code >> 4) & 0x07);
                 if (!scan) {
-                    cpu.key_code_hw = cpu.keymap[size].key_code;
-                    cpu.key_count_hw = cpu.key_press_cycle * 10;
+                    key->key_code_hw = key->keymap[size].key_code;
+                    key->key_count_hw = key->key_press_cycle * 10;
                 }
                 else {
-                    cpu.key_code = cpu.keymap[size].key_code;
-                    cpu.key_count = cpu.key_press_cycle;
+                    key->key_code = key->keymap[size].key_code;
+                    key->key_count = key->key_press_cycle;
                 }
             }
             else {
                 /* only revert key state */
-                cpu.key[cpu.keymap[size].key_code & 0x0F] ^= 1 << ((cpu.keymap[size].key_code >> 4) & 0x07);
+                key->key[key->keymap[size].key_code & 0x0F] ^= 1 << ((key->keymap[size].key_code >> 4) & 0x07);
             }
 
 #ifdef TEST_MODE
@@ -404,11 +413,11 @@ static int key_read2(struct bus *bus, int block, int scan)
             if (!isdigit(AsciiChar) && AsciiChar != '.' && AsciiChar != 'n') {
                 snprintf(buffer, sizeof(buffer), " key %c (%x)",
                         AsciiChar=='\n'?'=':AsciiChar, AsciiChar);
-                display_dbgprint(buffer);
+                display_dbgprint(bus, buffer);
                 last_op = 1;
             }
             else if (last_op) {
-                display_dbgprint(" res");
+                display_dbgprint(bus, " res");
                 last_op = 0;
             }
 #endif
@@ -420,6 +429,7 @@ static int key_read2(struct bus *bus, int block, int scan)
 
 static int key_process(void *priv, struct bus *bus)
 {
+    struct key *key = priv;
     /* process the key at state S15 just after D state change and before key processing
      * at state S0 (for hold reason)
      */
@@ -430,198 +440,215 @@ static int key_process(void *priv, struct bus *bus)
             if (!scan) {
                 /* only scan=0 */
                 if (bus->dstate < 15 && bus->dstate > 0) {
-                    if (cpu.key_count_hw <= 0) {
-                        if (key_read2(bus, 0, 0) < 0)
-                            return -1;
+                    if (key->key_count_hw <= 0) {
+                        if ((bus->idle || !key->inject) &&
+                                key_read2(key, bus, 0, 0) < 0)
+                            return RUN_END_OF_INPUT;
                     }
                     else
-                        cpu.key_count_hw--;
-                    LOG("key read once %d D%d idle=%d ", cpu.key_count_hw, bus->dstate, bus->idle);
+                        key->key_count_hw--;
+                    LOG("key read once %d D%d idle=%d ", key->key_count_hw, bus->dstate, bus->idle);
                 }
             }
             else {
-                int scan_all_press = (bus->irg & 0xFF) == cpu.key_press_mask;
-                int scan_all_unpress = (bus->irg & 0xFF) == cpu.key_unpress_mask;
+                int scan_all_press = (bus->irg & 0xFF) == key->key_press_mask;
+                int scan_all_unpress = (bus->irg & 0xFF) == key->key_unpress_mask;
+                /* -I : key released, and the rom waits for the next one */
+                int ready = key->inject && key->key_count <= 0 &&
+                    bus->idle && bus->addr == key->wait_addr;
 
-                if (scan_all_press && cpu.key_count > 1) {
+                if (scan_all_press && key->key_count > 1) {
                     /* repeat key */
-                    cpu.key_count--;
-                    LOG("key repeat %d idle=%d addr=0x%x ", cpu.key_count, bus->idle, bus->addr);
+                    key->key_count--;
+                    LOG("key repeat %d idle=%d addr=0x%x ", key->key_count, bus->idle, bus->addr);
                 }
-                else if (scan_all_unpress &&
-                        cpu.key_count > -cpu.key_unpress_cycle) {
+                else if (scan_all_unpress && !ready &&
+                        key->key_count > -key->key_unpress_cycle) {
                     /* force no key  */
-                    cpu.key_code = 0;
-                    cpu.key_count--;
-                    LOG("key empty %d idle=%d addr=0x%x ", cpu.key_count, bus->idle, bus->addr);
-                    cpu.key_code_hw = 0;
-                    cpu.key_count_hw = 0;
+                    key->key_code = 0;
+                    key->key_count--;
+                    LOG("key empty %d idle=%d addr=0x%x ", key->key_count, bus->idle, bus->addr);
+                    key->key_code_hw = 0;
+                    key->key_count_hw = 0;
                 }
-                else if (scan_all_press && cpu.key_code == 0) {
+                else if (scan_all_press && key->key_code == 0 &&
+                        (bus->idle || !key->inject)) {
                     /* read new key */
-                    if (key_read2(bus, bus->idle, 1) < 0)
-                        return -1;
-                    LOG("key read %d code=%x addr=0x%x ", cpu.key_count, cpu.key_code, bus->addr);
-                    cpu.key_code_hw = cpu.key_code;
-                    cpu.key_count_hw = cpu.key_count;
+                    if (key_read2(key, bus, bus->idle, 1) < 0)
+                        return RUN_END_OF_INPUT;
+                    LOG("key read %d code=%x addr=0x%x ", key->key_count, key->key_code, bus->addr);
+                    key->key_code_hw = key->key_code;
+                    key->key_count_hw = key->key_count;
                 }
                 else {
                      /* previous state */
-                     LOG("key same state %d idle=%d addr=0x%x ", cpu.key_count, bus->idle, bus->addr);
+                     LOG("key same state %d idle=%d addr=0x%x ", key->key_count, bus->idle, bus->addr);
                 }
 
-                if (bus->dstate == (cpu.key_code & 0x0F) && cpu.key_count > 0) {
+                if (bus->dstate == (key->key_code & 0x0F) && key->key_count > 0) {
                     /* key_count = 2 and 1 */
-                    bus->key_line |= 1 << ((cpu.key_code >> 4) & 0x07);
+                    bus->key_line |= 1 << ((key->key_code >> 4) & 0x07);
                 }
             }
         }
 
-        if (bus->dstate == (cpu.key_code_hw & 0x0F) && cpu.key_count_hw > 0) {
+        if (bus->dstate == (key->key_code_hw & 0x0F) && key->key_count_hw > 0) {
             /* key_count = 2 and 1 */
-            bus->key_line |= 1 << ((cpu.key_code_hw >> 4) & 0x07);
+            bus->key_line |= 1 << ((key->key_code_hw >> 4) & 0x07);
         }
 
-        bus->key_line |= cpu.key[bus->dstate];
-
-#ifdef KEEP_RUN
-        // real speed simulation
-        // 455kHz / 2 / 16 = 14219
-        // 20ms ~ 284.375 instructions
-        // 50ms ~ 710.9375 instructions
-        if ((cpu.cycle - cpu.ex_cnt) > EMUL_CYCLE) {
-            cpu.ex_cnt += EMUL_CYCLE;
-            while ((GetTickCount () - cpu.tick) < EMUL_TICK)
-                Sleep (EMUL_TICK);
-            cpu.tick += EMUL_TICK;
-        }
-        if (bus->idle)
-            cpu.cycle += 4;
-        else
-            cpu.cycle++;
-#endif
-
-
+        bus->key_line |= key->key[bus->dstate];
     }
     return 0;
 }
 
-static void key_init2(void)
+/* keymap and timings come from the model */
+static int key_save(void *priv, FILE *f)
 {
-    cpu.tick = GetTickCount ();
-    setbuf(stdout, NULL);
-
-    //	int flags = fcntl(0, F_GETFL, 0);
-    //	fcntl(0, F_SETFL, flags | O_NONBLOCK);
-
-    tcgetattr(0, &stored_settings);
-
-    // copy existing setting flags
-    new_settings = stored_settings;
+    struct key *key = priv;
+    int ret = 0;
+    ret |= SNAP_PUT(f, key->key);
+    ret |= SNAP_PUT(f, key->key_code);
+    ret |= SNAP_PUT(f, key->key_count);
+    ret |= SNAP_PUT(f, key->key_code_hw);
+    ret |= SNAP_PUT(f, key->key_count_hw);
+    ret |= SNAP_PUT(f, key->debug_code);
+    ret |= SNAP_PUT(f, key->wait_addr);
+    return ret;
+}
 
-    // modify flags
-    // first, disable canonical mode
-    // (canonical mode is the typical line-oriented input method)
-    new_settings.c_lflag &= (~ICANON);
-    new_settings.c_lflag &= (~ECHO); // don't echo the character
-    //new_settings.c_lflag &= (~ISIG); // don't automatically handle control-C
+static int key_restore(void *priv, FILE *f)
+{
+    struct key *key = priv;
+    int ret = 0;
+    ret |= SNAP_GET(f, key->key);
+    ret |= SNAP_GET(f, key->key_code);
+    ret |= SNAP_GET(f, key->key_count);
+    ret |= SNAP_GET(f, key->key_code_hw);
+    ret |= SNAP_GET(f, key->key_count_hw);
+    ret |= SNAP_GET(f, key->debug_code);
+    ret |= SNAP_GET(f, key->wait_addr);
+    return ret;
+}
 
-    new_settings.c_cc[VTIME] = 0; // timeout (tenths of a second)
-    new_settings.c_cc[VMIN] = 0; // minimum number of characters
+static void key_destroy(void *priv)
+{
+    struct key *key = priv;
 
-    new_settings_scan = new_settings;
-    new_settings_scan.c_cc[VTIME] = 10; // timeout (tenths of a second)
-    new_settings_scan.c_cc[VMIN] = 1; // minimum number of characters
+    input_free(&key->input);
+    free(key);
+}
 
-    // apply the new settings
-    tcsetattr(0, TCSANOW, &new_settings_scan);
+static void key_init2(struct key *key, int fd)
+{
+    setbuf(stdout, NULL);
 
+    key->input.tty = -1;
+    key->input.epfd = -1;
+    key->input.timer = -1;
+    key->input.wake = -1;
+    input_setup(fd);
 }
 
 
-int key_init(struct chip *chip, const char *name, enum hw hw_opt)
+int key_init(struct machine *m, struct chip *chip, const char *name, enum hw hw_opt)
 {
+    struct key *key = calloc(1, sizeof(*key));
+
+    if (!key)
+        return -1;
     if (!name)
         name = "sr50";
-    key_init2();
-    chip->priv = NULL;
+    key_init2(key, m->in_fd);
+    m->key = key;
+    chip->priv = key;
     chip->process = key_process;
+    /* a hold cycle only output the key line */
+    chip->hold = key_process;
+    chip->save = key_save;
+    chip->restore = key_restore;
+    chip->destroy = key_destroy;
+    chip->slots = SLOT(15, 0);
 
     printf("keymap %s\n", name);
-    cpu.key_unpress_cycle = 3;
-    cpu.key_press_cycle = 2;
-    cpu.key_press_mask = 0x20;
-    cpu.key_unpress_mask = 0x20;
-    cpu.key_count = 1;
-    cpu.key_code = 1;
+    key->key_unpress_cycle = 3;
+    key->key_press_cycle = 2;
+    key->key_press_mask = 0x20;
+    key->key_unpress_mask = 0x20;
+    key->key_count = 1;
+    key->key_code = 1;
+    key->inject = m->key_inject;
+    key->wait_addr = -1;
 
     if (!strcmp(name, "ti58c")) {
-        cpu.key_unpress_mask = 0x24;
-        cpu.keymap = key_table_ti58;
+        key->key_unpress_mask = 0x24;
+        key->keymap = key_table_ti58;
         printf(key_help_ti58);
         /* printer detection */
         if (hw_opt & HW_PRINTER)
-            cpu.key[10] |= (1 << KP_BIT);
+            key->key[10] |= (1 << KP_BIT);
     }
     else if (!strcmp(name, "ti58")) {
         /* if unset, enable card reader code
          */
-        cpu.key[7] |= (1 << KR_BIT);
-        cpu.keymap = key_table_ti58;
+        key->key[7] |= (1 << KR_BIT);
+        key->keymap = key_table_ti58;
         printf(key_help_ti58);
         /* printer detection */
         if (hw_opt & HW_PRINTER)
-            cpu.key[0] |= (1 << KP_BIT);
+            key->key[0] |= (1 << KP_BIT);
     }
     else if (!strcmp(name, "ti59")) {
         /* close card reader */
-        cpu.key[10] |= (1 << KR_BIT);
-        cpu.keymap = key_table_ti58;
+        key->key[10] |= (1 << KR_BIT);
+        key->keymap = key_table_ti58;
         printf(key_help_ti58);
         /* printer detection */
         if (hw_opt & HW_PRINTER)
-            cpu.key[0] |= (1 << KP_BIT);
+            key->key[0] |= (1 << KP_BIT);
     }
     else if (!strcmp(name, "sr51-II")) {
-        cpu.keymap = key_table_sr51II;
+        key->keymap = key_table_sr51II;
         printf(key_help_sr51II);
     }
     else if (!strcmp(name, "sr51")) {
-        cpu.key_press_cycle = 1;
-        cpu.keymap = key_table_sr51;
+        key->key_press_cycle = 1;
+        key->keymap = key_table_sr51;
         printf(key_help_sr51);
         /* no printer detection on sr51 */
     }
     else if (!strcmp(name, "sr60")) {
-        cpu.keymap = key_table_sr60;
+        key->keymap = key_table_sr60;
         printf(key_help_sr60);
-        cpu.key_press_cycle = 3;
+        key->key_press_cycle = 3;
     }
     else if (!strcmp(name, "sr52")) {
-        cpu.keymap = key_table_sr52;
+        key->keymap = key_table_sr52;
         printf(key_help_sr52);
         /* printer detection */
         if (hw_opt & HW_PRINTER)
-            cpu.key[0] |= (1 << KP_BIT);
+            key->key[0] |= (1 << KP_BIT);
     }
     else if (!strcmp(name, "sr56")) {
-        cpu.keymap = key_table_sr56;
+        key->keymap = key_table_sr56;
         printf(key_help_sr56);
         /* printer detection */
         if (hw_opt & HW_PRINTER)
-            cpu.key[0] |= (1 << KP_BIT);
+            key->key[0] |= (1 << KP_BIT);
     }
     else {
-        cpu.keymap = key_table_sr50;
+        key->keymap = key_table_sr50;
         printf(key_help_sr50);
     }
     return 0;
 }
 
-int crd_clear_switch(void)
+int crd_clear_switch(struct bus *bus)
 {
+    struct key *key = bus->machine->key;
+
     /* close card reader */
-    cpu.key[10] |= (1 << KR_BIT);
+    key->key[10] |= (1 << KR_BIT);
 
     return 0;
 }
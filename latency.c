@@ -0,0 +1,209 @@
+/*
+ * Copyright (C) 2024 by Matthieu CASTET <castet.matthieu@free.fr>
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include "emu.h"
+
+/**
+ * Key latency (-H) : instruction cycles and host time from the key press
+ * to the result, per key code.
+ *
+ * The measure starts when the key chip presses a key, and ends at the
+ * first display scan that is idle and the same as the previous one,
+ * after the rom has reacted (busy or display change). A key without
+ * result before the next key is counted as lost.
+ *
+ * The histograms are written at the end of the run, and on SIGUSR1 (at
+ * the next display scan). Each SIGUSR1 is a new dump generation : all
+ * the machines of the process (batch) write their file once for it.
+ * In a batch, the file name ends with the job name (file.job), so jobs
+ * using the same -H file don't overwrite each other.
+ */
+
+static volatile sig_atomic_t latency_dump;
+
+static void latency_signal(int sig)
+{
+    (void)sig;
+    latency_dump++;
+    /* a parked machine dumps at the next scan */
+    input_wake();
+}
+
+struct latency *latency_new(const char *model, const char *name)
+{
+    struct latency *l = calloc(1, sizeof(*l));
+
+    if (!l)
+        return NULL;
+    l->model = model;
+    l->name = name;
+    l->code = -1;
+    l->dump = latency_dump;
+    signal(SIGUSR1, latency_signal);
+    return l;
+}
+
+/* 0 : 0, b : [2^(b-1), 2^b - 1] */
+static unsigned bucket(uint64_t x)
+{
+    return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+static uint64_t bucket_min(unsigned b)
+{
+    return b ? 1ULL << (b - 1) : 0;
+}
+
+static uint64_t bucket_max(unsigned b)
+{
+    return b < 64 ? (1ULL << b) - 1 : UINT64_MAX;
+}
+
+void latency_press(struct latency *l, struct machine *m, int code, int c)
+{
+    if (l->code >= 0)
+        l->keys[l->code].lost++;
+    l->code = code & (LATENCY_KEYS - 1);
+    l->keys[l->code].c = c;
+    l->start_cycle = m->cycle;
+    l->start_ns = profile_now();
+    l->reacted = 0;
+}
+
+static void latency_end(struct latency *l, struct machine *m)
+{
+    struct latency_key *k = &l->keys[l->code];
+    uint64_t cycles = m->cycle - l->start_cycle;
+    uint64_t ns = profile_now() - l->start_ns;
+
+    if (!k->count || cycles < k->cycles_min)
+        k->cycles_min = cycles;
+    if (cycles > k->cycles_max)
+        k->cycles_max = cycles;
+    if (!k->count || ns < k->ns_min)
+        k->ns_min = ns;
+    if (ns > k->ns_max)
+        k->ns_max = ns;
+    k->count++;
+    k->cycles += cycles;
+    k->ns += ns;
+    k->hist_cycles[bucket(cycles)]++;
+    k->hist_ns[bucket(ns)]++;
+    l->code = -1;
+}
+
+/* end of a display scan */
+void latency_scan(struct latency *l, struct machine *m, int idle, int changed)
+{
+    if (l->dump != latency_dump) {
+        l->dump = latency_dump;
+        if (latency_save(l, m->job))
+            fprintf(m->out, "can't save latency '%s'\n", l->name);
+    }
+    if (l->code < 0)
+        return;
+    if (!idle || changed)
+        l->reacted = 1;
+    else if (l->reacted)
+        latency_end(l, m);
+}
+
+static void hist(FILE *f, const struct latency_key *k)
+{
+    for (unsigned b = 0; b < LATENCY_BUCKETS; b++) {
+        if (k->hist_cycles[b])
+            fprintf(f, "  cycles %10llu-%-10llu %10llu\n",
+                    (unsigned long long)bucket_min(b),
+                    (unsigned long long)bucket_max(b),
+                    (unsigned long long)k->hist_cycles[b]);
+    }
+    for (unsigned b = 0; b < LATENCY_BUCKETS; b++) {
+        if (k->hist_ns[b])
+            fprintf(f, "  us     %10.3f-%-10.3f %10llu\n",
+                    bucket_min(b) / 1e3, bucket_max(b) / 1e3,
+                    (unsigned long long)k->hist_ns[b]);
+    }
+}
+
+/* job : batch job name, NULL if not in a batch */
+int latency_save(struct latency *l, const char *job)
+{
+    char name[strlen(l->name) + (job ? strlen(job) + 1 : 0) + 1];
+    FILE *f;
+    uint64_t total = 0;
+    int order[LATENCY_KEYS];
+    int num = 0;
+
+    if (job)
+        sprintf(name, "%s.%s", l->name, job);
+    else
+        strcpy(name, l->name);
+    f = fopen(name, "w");
+    if (!f)
+        return 1;
+    for (int i = 0; i < LATENCY_KEYS; i++) {
+        total += l->keys[i].cycles;
+        if (l->keys[i].count || l->keys[i].lost)
+            order[num++] = i;
+    }
+    /* by total cycles */
+    for (int i = 1; i < num; i++) {
+        int x = order[i], j = i;
+
+        while (j > 0 && l->keys[order[j - 1]].cycles < l->keys[x].cycles) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = x;
+    }
+
+    fprintf(f, "latency %s : %llu cycles\n\n", l->model,
+            (unsigned long long)total);
+    fprintf(f, "key     count   lost   cycles%%  cycles min/avg/max"
+            "            time(us) min/avg/max\n");
+    for (int i = 0; i < num; i++) {
+        const struct latency_key *k = &l->keys[order[i]];
+        uint64_t n = k->count ? k->count : 1;
+
+        fprintf(f, "%02X %c %8llu %6llu %7.2f%% %8llu %10.1f %8llu"
+                " %10.1f %10.1f %10.1f\n",
+                order[i], k->c > ' ' && k->c < 0x7F ? k->c : ' ',
+                (unsigned long long)k->count, (unsigned long long)k->lost,
+                total ? 100.0 * k->cycles / total : 0,
+                (unsigned long long)k->cycles_min, (double)k->cycles / n,
+                (unsigned long long)k->cycles_max,
+                k->ns_min / 1e3, k->ns / 1e3 / n, k->ns_max / 1e3);
+    }
+    fprintf(f, "\nhistograms (cycles, time in us)\n");
+    for (int i = 0; i < num; i++) {
+        const struct latency_key *k = &l->keys[order[i]];
+
+        if (!k->count)
+            continue;
+        fprintf(f, "key %02X %c\n", order[i],
+                k->c > ' ' && k->c < 0x7F ? k->c : ' ');
+        hist(f, k);
+    }
+    return fclose(f) != 0;
+}
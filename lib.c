@@ -60,6 +60,11 @@ struct lib {
  */
  
 
+static const struct chip_irg lib_irg[] = {
+    {0xFFCF, 0x0A0E},
+    {0, 0}
+};
+
 static int lib_process(void *priv, struct bus *bus)
 {
     struct lib *lib = priv;
@@ -67,6 +72,8 @@ static int lib_process(void *priv, struct bus *bus)
         if (lib->flags_delay & WAIT_IN_DATA) {
             int data = lib->data[lib->pc];
             bus->ext |= data << 3;
+            if (bus->machine->coverage)
+                coverage_hit(bus->machine->coverage->crom_hit, lib->pc);
 		    LOG ("LIB.data[%04d]=%02x ", lib->pc, data);
             lib->pc++;
             if (lib->pc >= MAX_DATA)
@@ -80,6 +87,8 @@ static int lib_process(void *priv, struct bus *bus)
         else if (lib->flags_delay & WAIT_IN_DATA_HIGH) {
             int data = lib->data[lib->pc] >> 4;
             bus->ext |= data << 3;
+            if (bus->machine->coverage)
+                coverage_hit(bus->machine->coverage->crom_hit, lib->pc);
 		    LOG ("LIB.data_high[%04d]=%02x ", lib->pc, data);
         }
     }
@@ -145,6 +154,31 @@ static void dis(struct lib *lib)
 }
 
 
+static int lib_save(void *priv, FILE *f)
+{
+    struct lib *lib = priv;
+    int ret = 0;
+    ret |= SNAP_PUT(f, lib->pc);
+    ret |= SNAP_PUT(f, lib->flags);
+    ret |= SNAP_PUT(f, lib->flags_delay);
+    return ret;
+}
+
+static int lib_restore(void *priv, FILE *f)
+{
+    struct lib *lib = priv;
+    int ret = 0;
+    ret |= SNAP_GET(f, lib->pc);
+    ret |= SNAP_GET(f, lib->flags);
+    ret |= SNAP_GET(f, lib->flags_delay);
+    return ret;
+}
+
+static void lib_coverage(void *priv, struct coverage *c)
+{
+    coverage_set(c->crom, 0, MAX_DATA);
+}
+
 int lib_init(struct chip *chip, const char *name, int disasm)
 {
     struct lib *lib;
@@ -182,6 +216,13 @@ int lib_init(struct chip *chip, const char *name, int disasm)
 
     chip->priv = lib;
     chip->process = lib_process;
+    chip->save = lib_save;
+    chip->restore = lib_restore;
+    chip->coverage = lib_coverage;
+    chip->slots = SLOT(15, 1) | SLOT(15, 0);
+    chip->irg = lib_irg;
+    /* ext out at cycle 3 */
+    chip->irg_delay = 2;
 
     if (disasm)
         dis(lib);
@@ -0,0 +1,286 @@
+/*
+ * Copyright (C) 2024 by Matthieu CASTET <castet.matthieu@free.fr>
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdio_ext.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include "emu.h"
+
+/**
+ * Log file written by a thread.
+ *
+ * log_file is a stdio stream without locking (only the emulator thread
+ * use it). Its buffer is copied in the chunks of a single producer /
+ * single consumer ring, and full chunks are written to the file by a
+ * writer thread, in one write() each.
+ *
+ * When the ring is full, the emulator waits for the writer (default),
+ * or the chunk is dropped (-L). Both are counted and printed at exit.
+ *
+ * Both sides sleep on an eventfd : the emulator writes wake when it
+ * pushes a chunk (or at the end), the writer writes space when it has
+ * written one.
+ */
+
+#define LOG_CHUNK_SIZE (64 * 1024)
+#define LOG_CHUNKS 64
+
+struct log_chunk {
+    size_t len;
+    char data[LOG_CHUNK_SIZE];
+};
+
+struct log_queue {
+    FILE *file;
+    int fd;
+    int drop;
+    /* chunks [tail, head) are ready for the writer */
+    _Atomic uint64_t head;
+    _Atomic uint64_t tail;
+    atomic_int done;
+    int wake, space;
+    int started;
+    pthread_t thread;
+    /* producer side counters */
+    unsigned long long waits;
+    unsigned long long dropped;
+    int write_error;
+    struct log_chunk chunks[LOG_CHUNKS];
+};
+
+static struct log_queue *log_queue;
+
+static void log_signal(int fd)
+{
+    uint64_t one = 1;
+
+    if (write(fd, &one, sizeof(one)) < 0)
+        return;
+}
+
+/* wait for a log_signal on fd, at most timeout ms (-1 : no limit) */
+static void log_wait(int fd, int timeout)
+{
+    struct pollfd p = { .fd = fd, .events = POLLIN };
+    uint64_t count;
+
+    if (poll(&p, 1, timeout) > 0 && read(fd, &count, sizeof(count)) < 0)
+        return;
+}
+
+static int write_all(int fd, const char *p, size_t len)
+{
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n <= 0)
+            return 1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void *log_writer(void *arg)
+{
+    struct log_queue *q = arg;
+
+    for (;;) {
+        uint64_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        int done = atomic_load_explicit(&q->done, memory_order_acquire);
+
+        if (tail == atomic_load_explicit(&q->head, memory_order_acquire)) {
+            if (done)
+                break;
+            log_wait(q->wake, -1);
+            continue;
+        }
+        struct log_chunk *c = &q->chunks[tail % LOG_CHUNKS];
+
+        if (write_all(q->fd, c->data, c->len))
+            q->write_error = 1;
+        atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+        log_signal(q->space);
+    }
+    return NULL;
+}
+
+/* hand the current chunk to the writer, and get an empty one */
+static void log_push(struct log_queue *q)
+{
+    uint64_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+    if (!q->chunks[head % LOG_CHUNKS].len)
+        return;
+    if (!q->started) {
+        sigset_t all, old;
+
+        /* started at first use : a fork (-X) before logging has its own.
+         * Signals are handled by the emulator thread, see log_signal_flush
+         */
+        q->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        q->space = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        q->started = q->wake >= 0 && q->space >= 0 &&
+            pthread_create(&q->thread, NULL, log_writer, q) == 0;
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        if (!q->started) {
+            q->write_error = 1;
+            q->chunks[head % LOG_CHUNKS].len = 0;
+            return;
+        }
+    }
+    /* the next chunk must be free */
+    while (head + 1 - atomic_load_explicit(&q->tail, memory_order_acquire)
+            >= LOG_CHUNKS) {
+        if (q->drop) {
+            q->dropped += q->chunks[head % LOG_CHUNKS].len;
+            q->chunks[head % LOG_CHUNKS].len = 0;
+            return;
+        }
+        q->waits++;
+        log_wait(q->space, -1);
+    }
+    /* empty before it is published : log_signal_flush writes up to head */
+    q->chunks[(head + 1) % LOG_CHUNKS].len = 0;
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    log_signal(q->wake);
+}
+
+/* stdio buffer of log_file is full */
+static ssize_t log_cookie_write(void *cookie, const char *buf, size_t size)
+{
+    struct log_queue *q = cookie;
+    size_t left = size;
+
+    while (left) {
+        uint64_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+        struct log_chunk *c = &q->chunks[head % LOG_CHUNKS];
+        size_t n = LOG_CHUNK_SIZE - c->len;
+
+        if (n > left)
+            n = left;
+        memcpy(c->data + c->len, buf, n);
+        c->len += n;
+        buf += n;
+        left -= n;
+        if (c->len == LOG_CHUNK_SIZE)
+            log_push(q);
+    }
+    return size;
+}
+
+static int log_cookie_close(void *cookie)
+{
+    struct log_queue *q = cookie;
+
+    return close(q->fd);
+}
+
+/* write the remaining log and stop the writer */
+void log_close(void)
+{
+    struct log_queue *q = log_queue;
+
+    if (!q)
+        return;
+    fflush(q->file);
+    log_push(q);
+    if (q->started) {
+        atomic_store_explicit(&q->done, 1, memory_order_release);
+        log_signal(q->wake);
+        pthread_join(q->thread, NULL);
+    }
+    if (q->wake >= 0)
+        close(q->wake);
+    if (q->space >= 0)
+        close(q->space);
+    if (q->dropped || q->waits || q->write_error)
+        fprintf(stderr, "log: %llu bytes dropped, %llu waits for writer%s\n",
+                q->dropped, q->waits, q->write_error ? ", write error" : "");
+    if (log_file == q->file)
+        log_file = stdout;
+    log_queue = NULL;
+    fclose(q->file);
+    free(q);
+}
+
+/* from a signal handler in the emulator thread : let the writer finish
+ * the full chunks, then write the current one. Only async signal safe
+ * calls : the stdio buffer (last BUFSIZ bytes at most) is lost.
+ */
+void log_signal_flush(void)
+{
+    struct log_queue *q = log_queue;
+    uint64_t head;
+    struct log_chunk *c;
+
+    if (!q)
+        return;
+    head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    /* at most 1s, the writer may be stuck */
+    for (int i = 0; i < 1000 && q->started &&
+            atomic_load_explicit(&q->tail, memory_order_acquire) != head; i++)
+        log_wait(q->space, 1);
+    c = &q->chunks[head % LOG_CHUNKS];
+    if (!write_all(q->fd, c->data, c->len))
+        c->len = 0;
+}
+
+/* log_file is set to the opened file. drop : don't wait for a slow writer */
+int log_open(const char *name, int drop)
+{
+    static const cookie_io_functions_t io = {
+        .write = log_cookie_write,
+        .close = log_cookie_close,
+    };
+    struct log_queue *q = calloc(1, sizeof(*q));
+
+    if (!q)
+        return 1;
+    q->fd = open(name, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (q->fd < 0) {
+        free(q);
+        return 1;
+    }
+    q->file = fopencookie(q, "a", io);
+    if (!q->file) {
+        close(q->fd);
+        free(q);
+        return 1;
+    }
+    setvbuf(q->file, NULL, _IOFBF, BUFSIZ);
+    __fsetlocking(q->file, FSETLOCKING_BYCALLER);
+    q->drop = drop;
+    q->wake = q->space = -1;
+    log_queue = q;
+    log_file = q->file;
+    atexit(log_close);
+    return 0;
+}
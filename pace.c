@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2024 by Matthieu CASTET <castet.matthieu@free.fr>
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include "emu.h"
+
+/**
+ * Real time pacing (-x speed) : the machine runs at speed times the
+ * calculator clock.
+ *
+ * 455kHz clock, 32 clocks per instruction cycle. An idle cycle
+ * (display) counts as 4 cycles.
+ *
+ * The emulator sleeps until the host time of the emulated time, with
+ * absolute deadlines from a start point : a late wake up is not added
+ * to the next sleep. When the host is behind by more than PACE_LATE_MAX
+ * (blocked reading a key, slow host), the start point moves to now, the
+ * late time is not run faster afterward.
+ */
+
+#define PACE_CLOCK 455000
+/* host time between two sleeps */
+#define PACE_STEP_NS 10000000ULL
+#define PACE_LATE_MAX_NS 100000000ULL
+
+static unsigned long long pace_now(void)
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+}
+
+/* speed : 1 for real speed */
+struct pace *pace_new(double speed)
+{
+    struct pace *p = calloc(1, sizeof(*p));
+
+    if (!p)
+        return NULL;
+    p->cycle_ns = 1e9 * 32 / PACE_CLOCK / speed;
+    p->step = PACE_STEP_NS / p->cycle_ns;
+    if (!p->step)
+        p->step = 1;
+    return p;
+}
+
+/* host ns of idle cycles */
+unsigned long long pace_idle_ns(const struct pace *p, unsigned long long cycles)
+{
+    return cycles * 4 * p->cycle_ns;
+}
+
+/* the emulator waited ns for a key : return the idle cycles the
+ * calculator would have run meanwhile (whole display scans, at most max),
+ * added to the time
+ */
+unsigned long long pace_idle(struct pace *p, unsigned long long ns,
+        unsigned long long max)
+{
+    unsigned long long cycles = ns / (4 * p->cycle_ns);
+
+    if (cycles >= max)
+        cycles = max;
+    else
+        cycles -= cycles % 16;
+    p->time += cycles * 4;
+    return cycles;
+}
+
+/* time reached p->next */
+void pace_wait(struct pace *p)
+{
+    unsigned long long now = pace_now();
+    unsigned long long deadline;
+
+    if (!p->start_ns) {
+        p->start_ns = now;
+        p->start_time = p->time;
+    }
+    deadline = p->start_ns + (unsigned long long)
+        ((p->time - p->start_time) * p->cycle_ns);
+    if (now > deadline + PACE_LATE_MAX_NS) {
+        p->start_ns = now;
+        p->start_time = p->time;
+    }
+    else if (deadline > now) {
+        struct timespec ts = {
+            .tv_sec = deadline / 1000000000ULL,
+            .tv_nsec = deadline % 1000000000ULL,
+        };
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+                == EINTR)
+            ;
+    }
+    p->next = p->time + p->step;
+}
@@ -29,6 +29,7 @@ struct print {
     int busy;
     uint32_t mask;
     const char *print_font;
+    struct chip_irg irg[2];
 };
 
 /* table are present in ti59 service manual and
@@ -226,15 +227,15 @@ static int print_process(void *priv, struct bus *bus)
             case 0x0AA6:
                 /* print */
                 if (bus->irg == 0x0AA6)
-                    display_ext(print->buffer);
+                    display_ext(bus, print->buffer);
                 else
-                    display_print(print->buffer);
+                    display_print(bus, print->buffer);
                 LOG("PRINT[%d]='%.20s' ", print->head, print->buffer);
                 break;
             case 0x0AB8:
                 /* advance half line */
                 /* XXX we advance one line instead of half */
-                display_print("");
+                display_print(bus, "");
                 break;
         }
     }
@@ -243,6 +244,26 @@ static int print_process(void *priv, struct bus *bus)
 
 
 
+static int print_save(void *priv, FILE *f)
+{
+    struct print *print = priv;
+    int ret = 0;
+    ret |= SNAP_PUT(f, print->buffer);
+    ret |= SNAP_PUT(f, print->head);
+    ret |= SNAP_PUT(f, print->busy);
+    return ret;
+}
+
+static int print_restore(void *priv, FILE *f)
+{
+    struct print *print = priv;
+    int ret = 0;
+    ret |= SNAP_GET(f, print->buffer);
+    ret |= SNAP_GET(f, print->head);
+    ret |= SNAP_GET(f, print->busy);
+    return ret;
+}
+
 int printer_init(struct chip *chip, enum printer_type type)
 {
     struct print *printer;
@@ -254,10 +275,17 @@ int printer_init(struct chip *chip, enum printer_type type)
     printer->busy = 0;
     chip->priv = printer;
     chip->process = print_process;
+    chip->save = print_save;
+    chip->restore = print_restore;
+    chip->slots = SLOT(15, 0);
     if (type == TMC0253)
         printer->mask = 0x0A06;
     else
         printer->mask = 0x0A08;
+    printer->irg[0].mask = 0xFF0F;
+    printer->irg[0].value = printer->mask;
+    printer->irg[1].mask = 0;
+    chip->irg = printer->irg;
 
     if (type == TMC0251)
         printer->print_font = print_font;
@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2024 by Matthieu CASTET <castet.matthieu@free.fr>
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "bus.h"
+#include "emu.h"
+
+/**
+ * Rom execution profile : fetch count and host time per rom address.
+ *
+ * The time of an instruction is the time until the next fetch, so it
+ * includes all the chips running during this instruction cycle.
+ *
+ * The listing is split in basic blocks : a block starts at a branch
+ * target, after a branch, or where the fetch count changes (PREG jump,
+ * HOLD, unexecuted code).
+ */
+
+struct profile_block {
+    unsigned start, end;
+    uint64_t count;
+    uint64_t ns;
+};
+
+uint64_t profile_now(void)
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+}
+
+struct profile *profile_new(void)
+{
+    struct profile *p = calloc(1, sizeof(*p));
+
+    if (p)
+        p->last_ns = profile_now();
+    return p;
+}
+
+static int is_branch(unsigned opcode)
+{
+    return opcode & IRG_BRANCH_MASK;
+}
+
+static unsigned branch_target(unsigned addr, unsigned opcode)
+{
+    unsigned offset = (opcode >> 1) & 0x3FF;
+
+    return ((opcode & 1) ? addr - offset : addr + offset) & (PROFILE_SIZE - 1);
+}
+
+static int block_cmp(const void *a, const void *b)
+{
+    const struct profile_block *x = a, *y = b;
+
+    if (x->ns != y->ns)
+        return x->ns < y->ns ? 1 : -1;
+    return x->start < y->start ? -1 : 1;
+}
+
+/* split executed addresses in blocks, return the number of blocks.
+ * target : PROFILE_SIZE bytes of work space
+ */
+static int profile_blocks(const struct profile *p, struct profile_block *blocks,
+        uint8_t *target)
+{
+    int num = -1;
+
+    memset(target, 0, PROFILE_SIZE);
+    for (unsigned a = 0; a < PROFILE_SIZE; a++) {
+        if (p->count[a] && is_branch(p->opcode[a]))
+            target[branch_target(a, p->opcode[a])] = 1;
+    }
+    for (unsigned a = 0; a < PROFILE_SIZE; a++) {
+        if (!p->count[a])
+            continue;
+        if (num < 0 || !a || target[a] || p->count[a] != p->count[a - 1] ||
+                is_branch(p->opcode[a - 1])) {
+            num++;
+            blocks[num].start = a;
+            blocks[num].count = p->count[a];
+            blocks[num].ns = 0;
+        }
+        blocks[num].end = a;
+        blocks[num].ns += p->ns[a];
+    }
+    return num + 1;
+}
+
+static double percent(uint64_t x, uint64_t total)
+{
+    return total ? 100.0 * x / total : 0;
+}
+
+/* batch threads save at the same time : no static buffer, no log_file */
+int profile_save(struct profile *p, const char *name)
+{
+    struct profile_block *blocks = malloc(PROFILE_SIZE * sizeof(*blocks));
+    struct profile_block *sorted = malloc(PROFILE_SIZE * sizeof(*sorted));
+    uint8_t *target = malloc(PROFILE_SIZE);
+    FILE *f = fopen(name, "w");
+    uint64_t count = 0, ns = 0, cum = 0;
+    unsigned check = 0;
+    int num, b = 0;
+    int ret;
+
+    if (!blocks || !sorted || !target || !f) {
+        free(blocks);
+        free(sorted);
+        free(target);
+        if (f)
+            fclose(f);
+        return 1;
+    }
+    /* time of the last instruction */
+    p->ns[p->last] += profile_now() - p->last_ns;
+    p->last_ns = profile_now();
+
+    for (unsigned a = 0; a < PROFILE_SIZE; a++) {
+        count += p->count[a];
+        ns += p->ns[a];
+    }
+    num = profile_blocks(p, blocks, target);
+    memcpy(sorted, blocks, num * sizeof(*blocks));
+    qsort(sorted, num, sizeof(*sorted), block_cmp);
+
+    fprintf(f, "profile : %llu instructions, %.3f ms\n\n",
+            (unsigned long long)count, ns / 1e6);
+    fprintf(f, "blocks by time\n");
+    fprintf(f, "start-end   entries        time(us)  time%%   cumul%%\n");
+    for (int i = 0; i < num && sorted[i].ns; i++) {
+        cum += sorted[i].ns;
+        fprintf(f, "%04X-%04X %10llu %14.1f %6.2f%% %7.2f%%\n",
+                sorted[i].start, sorted[i].end,
+                (unsigned long long)sorted[i].count, sorted[i].ns / 1e3,
+                percent(sorted[i].ns, ns), percent(cum, ns));
+    }
+
+    fprintf(f, "\nlisting\n");
+    fprintf(f, "     count  count%%       time(us)  time%%  addr opcode\n");
+    cum = 0;
+    for (unsigned a = 0; a < PROFILE_SIZE; a++) {
+        if (!p->count[a])
+            continue;
+        if (b < num && blocks[b].start == a) {
+            cum += blocks[b].ns;
+            fprintf (f, "\n; block %04X-%04X entries %llu time %.2f%% cumul %.2f%%\n",
+                    blocks[b].start, blocks[b].end,
+                    (unsigned long long)blocks[b].count,
+                    percent(blocks[b].ns, ns), percent(cum, ns));
+            b++;
+        }
+        fprintf (f, "%10llu %6.2f%% %14.1f %6.2f%%  %04X %04X\t",
+                (unsigned long long)p->count[a], percent(p->count[a], count),
+                p->ns[a] / 1e3, percent(p->ns[a], ns), a, p->opcode[a]);
+        disasm_file (f, &check, a, p->opcode[a]);
+        fprintf (f, "\n");
+    }
+    ret = fclose(f) != 0;
+    free(blocks);
+    free(sorted);
+    free(target);
+    return ret;
+}
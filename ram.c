@@ -40,6 +40,11 @@ struct ram {
     int addr;
 };
 
+static const struct chip_irg ram_irg[] = {
+    {0xFFFF, 0x0AF8},
+    {0, 0}
+};
+
 static int ram_process(void *priv, struct bus *bus)
 {
     struct ram *ram = priv;
@@ -105,6 +110,39 @@ static int ram_process(void *priv, struct bus *bus)
 }
 
 
+static int ram_dump_state(void *priv, struct bus *bus, FILE *f)
+{
+    struct ram *ram = priv;
+    for (int addr = 0; addr < ram->end - ram->start; addr++) {
+        fprintf(f, "RAM[%02d]=", addr + ram->start);
+        for (int i = 15; i >= 0; i--) fprintf(f, "%X", ram->data[addr][i]);
+        fprintf(f, "\n");
+    }
+    return 0;
+}
+
+static int ram_save(void *priv, FILE *f)
+{
+    struct ram *ram = priv;
+    int ret = 0;
+    ret |= SNAP_PUT(f, ram->data);
+    ret |= SNAP_PUT(f, ram->flags);
+    ret |= SNAP_PUT(f, ram->cmd);
+    ret |= SNAP_PUT(f, ram->addr);
+    return ret;
+}
+
+static int ram_restore(void *priv, FILE *f)
+{
+    struct ram *ram = priv;
+    int ret = 0;
+    ret |= SNAP_GET(f, ram->data);
+    ret |= SNAP_GET(f, ram->flags);
+    ret |= SNAP_GET(f, ram->cmd);
+    ret |= SNAP_GET(f, ram->addr);
+    return ret;
+}
+
 int ram_init(struct chip *chip, int addr)
 {
     struct ram *ram;
@@ -118,6 +156,13 @@ int ram_init(struct chip *chip, int addr)
     memset(ram->data, 0, 30*16);
     chip->priv = ram;
     chip->process = ram_process;
+    chip->slots = SLOT(0, 1) | SLOT(15, 0);
+    chip->dump_state = ram_dump_state;
+    chip->save = ram_save;
+    chip->restore = ram_restore;
+    chip->irg = ram_irg;
+    /* cmd on io at cycle 3, data at cycle 4 */
+    chip->irg_delay = 3;
     printf("ram base 0x%x size %d\n", ram->start, 30);
     return 0;
 }
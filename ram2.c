@@ -47,6 +47,12 @@ struct ram {
     int addr;
 };
 
+static const struct chip_irg ram_irg[] = {
+    {0xFFFF, 0x0A76},
+    {0xFFFF, 0x0A86},
+    {0, 0}
+};
+
 static int ram_process(void *priv, struct bus *bus)
 {
     struct ram *ram = priv;
@@ -86,6 +92,39 @@ static int ram_process(void *priv, struct bus *bus)
 }
 
 
+static int ram_dump_state(void *priv, struct bus *bus, FILE *f)
+{
+    struct ram *ram = priv;
+    for (int addr = 0; addr < ram->end - ram->start; addr++) {
+        fprintf(f, "RAM2[%02d]=", addr + ram->start);
+        for (int i = 15; i >= 0; i--) fprintf(f, "%X", ram->data[addr][i]);
+        fprintf(f, "\n");
+    }
+    return 0;
+}
+
+static int ram_save(void *priv, FILE *f)
+{
+    struct ram *ram = priv;
+    int ret = 0;
+    ret |= SNAP_PUT(f, ram->data);
+    ret |= SNAP_PUT(f, ram->flags);
+    ret |= SNAP_PUT(f, ram->cmd);
+    ret |= SNAP_PUT(f, ram->addr);
+    return ret;
+}
+
+static int ram_restore(void *priv, FILE *f)
+{
+    struct ram *ram = priv;
+    int ret = 0;
+    ret |= SNAP_GET(f, ram->data);
+    ret |= SNAP_GET(f, ram->flags);
+    ret |= SNAP_GET(f, ram->cmd);
+    ret |= SNAP_GET(f, ram->addr);
+    return ret;
+}
+
 int ram2_init(struct chip *chip, int addr)
 {
     struct ram *ram;
@@ -98,6 +137,13 @@ int ram2_init(struct chip *chip, int addr)
     memset(ram->data, 0xE, RAM_SIZE_NUMB*16);
     chip->priv = ram;
     chip->process = ram_process;
+    chip->slots = SLOT(0, 1) | SLOT(15, 0);
+    chip->dump_state = ram_dump_state;
+    chip->save = ram_save;
+    chip->restore = ram_restore;
+    chip->irg = ram_irg;
+    /* data at cycle 3 */
+    chip->irg_delay = 2;
     printf("ram base 0x%x size %d\n", ram->start, RAM_SIZE_NUMB);
     return 0;
 }
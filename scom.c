@@ -81,6 +81,29 @@ struct scom {
  */
 
 
+/* alu instruction reading constant : 0x0_C_/0x0_E_, not 0x00__/0x08__/0x0A__ */
+#define SCOM_CONST_IRG(m) {0x1FD0, ((m) << 8) | 0x00C0}
+#define SCOM_CONST_IRGS \
+    SCOM_CONST_IRG(0x1), SCOM_CONST_IRG(0x2), SCOM_CONST_IRG(0x3), \
+    SCOM_CONST_IRG(0x4), SCOM_CONST_IRG(0x5), SCOM_CONST_IRG(0x6), \
+    SCOM_CONST_IRG(0x7), SCOM_CONST_IRG(0x9), SCOM_CONST_IRG(0xB), \
+    SCOM_CONST_IRG(0xC), SCOM_CONST_IRG(0xD), SCOM_CONST_IRG(0xE), \
+    SCOM_CONST_IRG(0xF)
+
+static const struct chip_irg scom_irg[] = {
+    SCOM_CONST_IRGS,
+    {0xFF0F, 0x0A0F}, /* STO/RCL */
+    {0xFFFF, 0x0A09}, /* D sync check */
+    {0, 0}
+};
+
+static const struct chip_irg scom2_irg[] = {
+    SCOM_CONST_IRGS,
+    {0xFFEF, 0x0A0F}, /* STO F/RCL F */
+    {0xFFFF, 0x0A09}, /* D sync check */
+    {0, 0}
+};
+
 static int scom_const_process(struct scom *scom, struct bus *bus)
 {
     if (bus->sstate == 0 && bus->write) {
@@ -210,6 +233,37 @@ static int scom2_process(void *priv, struct bus *bus)
     return ret;
 }
 
+static int scom_dump_state(void *priv, struct bus *bus, FILE *f)
+{
+    struct scom *scom = priv;
+    for (int addr = 0; addr < scom->end_reg - scom->start_reg; addr++) {
+        fprintf(f, "SCOM.%d=", addr + scom->start_reg);
+        for (int i = 15; i >= 0; i--) fprintf(f, "%X", scom->SCOM[addr][i]);
+        fprintf(f, "\n");
+    }
+    return 0;
+}
+
+static int scom_save(void *priv, FILE *f)
+{
+    struct scom *scom = priv;
+    int ret = 0;
+    ret |= SNAP_PUT(f, scom->fifo_const);
+    ret |= SNAP_PUT(f, scom->SCOM);
+    ret |= SNAP_PUT(f, scom->fifo_reg);
+    return ret;
+}
+
+static int scom_restore(void *priv, FILE *f)
+{
+    struct scom *scom = priv;
+    int ret = 0;
+    ret |= SNAP_GET(f, scom->fifo_const);
+    ret |= SNAP_GET(f, scom->SCOM);
+    ret |= SNAP_GET(f, scom->fifo_reg);
+    return ret;
+}
+
 int scom_init(struct chip *chip, const char *name)
 {
     int base;
@@ -247,13 +301,21 @@ int scom_init(struct chip *chip, const char *name)
     memset(scom->SCOM, 0xC, sizeof(scom->SCOM));
 
     chip->priv = scom;
+    chip->slots = SLOT(0, 1) | SLOT(15, 0);
+    chip->dump_state = scom_dump_state;
+    chip->save = scom_save;
+    chip->restore = scom_restore;
+    /* STO/RCL fifo need 3 cycles to be flushed */
+    chip->irg_delay = 3;
     if (size > 16) {
         chip->process = scom2_process;
+        chip->irg = scom2_irg;
         scom->start_reg = base / 32 * 8;
         scom->end_reg = scom->start_reg + 8;
     }
     else {
         chip->process = scom_process;
+        chip->irg = scom_irg;
         scom->start_reg = base / 16 * 2;
         scom->end_reg = scom->start_reg + 2;
     }
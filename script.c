@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2024 by Matthieu CASTET <castet.matthieu@free.fr>
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "emu.h"
+
+/**
+ * Key script (-K) : keys with the instruction cycle they are pressed at,
+ * replayed without terminal. Recording (-Y) write the keys read in the
+ * same format.
+ *
+ * One line per time :
+ *   "- keys"       when the calculator is ready : next key read of an
+ *                  idle scan (where it would wait for a key)
+ *   "@cycle keys"  first key read from this cycle (idle or busy)
+ *   "+cycles keys" first key read cycles after the previous key
+ * The other keys of the line are pressed when ready. Keys are the
+ * keyboard characters (see the key map), with "\n" (Enter), "\e" (Esc),
+ * "\\" and "\xHH". Empty lines and lines starting with ';' are ignored.
+ *
+ * The calculator reads a key at a scan with no key pressed : a key is
+ * pressed at the first key read of its time, and released by the key
+ * chip as for a typed key. At the end of the script, the next blocking
+ * read ends the run (as the end of a key file).
+ */
+
+/* parse keys of a line, return 0 on success */
+static int script_keys(struct script *s, const char *p, int when,
+        unsigned long long cycle)
+{
+    while (*p) {
+        struct script_key *k;
+        unsigned char c = *p++;
+
+        if (c == '\\') {
+            c = *p++;
+            if (c == 'n')
+                c = '\n';
+            else if (c == 'e')
+                c = 0x1B;
+            else if (c == 'x' && isxdigit((unsigned char)*p)) {
+                /* one or two hex digits, as in C */
+                char hex[3] = { p[0], 0, 0 };
+                char *end;
+
+                if (isxdigit((unsigned char)p[1]))
+                    hex[1] = p[1];
+                c = strtoul(hex, &end, 16);
+                p += end - hex;
+            }
+            else if (c != '\\')
+                return 1;
+        }
+        if (s->num == s->size) {
+            unsigned size = s->size ? s->size * 2 : 64;
+
+            k = realloc(s->keys, size * sizeof(*k));
+            if (!k)
+                return 1;
+            s->keys = k;
+            s->size = size;
+        }
+        k = &s->keys[s->num++];
+        k->when = when;
+        k->cycle = cycle;
+        k->c = c;
+        when = SCRIPT_READY;
+    }
+    return 0;
+}
+
+struct script *script_load(const char *name)
+{
+    FILE *f = fopen(name, "r");
+    struct script *s;
+    char *line = NULL;
+    size_t size = 0;
+    int line_num = 0;
+
+    if (!f) {
+        printf("can't open key script '%s'\n", name);
+        return NULL;
+    }
+    s = calloc(1, sizeof(*s));
+    while (s && getline(&line, &size, f) >= 0) {
+        unsigned long long cycle = 0;
+        char *p = line;
+        int when;
+
+        line_num++;
+        line[strcspn(line, "\r\n")] = 0;
+        if (!line[0] || line[0] == ';')
+            continue;
+        if (line[0] == '-') {
+            when = SCRIPT_READY;
+            p++;
+        }
+        else if (line[0] == '@' || line[0] == '+') {
+            when = line[0] == '@' ? SCRIPT_AT : SCRIPT_AFTER;
+            cycle = strtoull(line + 1, &p, 0);
+            if (p == line + 1)
+                p = line;
+        }
+        else
+            p = line;
+        if (p == line || *p != ' ' || !p[1] ||
+                script_keys(s, p + 1, when, cycle)) {
+            printf("key script '%s' line %d invalid\n", name, line_num);
+            script_free(s);
+            s = NULL;
+        }
+    }
+    free(line);
+    fclose(f);
+    if (s)
+        printf("key script '%s' %u keys\n", name, s->num);
+    return s;
+}
+
+void script_free(struct script *s)
+{
+    if (!s)
+        return;
+    free(s->keys);
+    free(s);
+}
+
+/* key for a read at this cycle : return 1, 0 if not yet, -1 at the end
+ * of the script for a blocking read
+ */
+int script_get(struct script *s, unsigned long long cycle, int block,
+        unsigned char *c)
+{
+    const struct script_key *k;
+
+    if (!s->started) {
+        s->started = 1;
+        s->last = cycle;
+    }
+    if (s->pos == s->num)
+        return block ? -1 : 0;
+    k = &s->keys[s->pos];
+    if (k->when == SCRIPT_READY ? !block :
+            cycle < k->cycle + (k->when == SCRIPT_AFTER ? s->last : 0))
+        return 0;
+    s->pos++;
+    s->last = cycle;
+    *c = k->c;
+    return 1;
+}
+
+struct script_rec *script_rec_open(const char *name)
+{
+    struct script_rec *r = calloc(1, sizeof(*r));
+
+    if (!r)
+        return NULL;
+    r->f = fopen(name, "w");
+    if (!r->f) {
+        printf("can't create key record '%s'\n", name);
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+static void script_rec_put(FILE *f, unsigned char c)
+{
+    if (c == '\n')
+        fputs("\\n", f);
+    else if (c == 0x1B)
+        fputs("\\e", f);
+    else if (c == '\\')
+        fputs("\\\\", f);
+    else if (isgraph(c) || c == ' ')
+        fputc(c, f);
+    else
+        fprintf(f, "\\x%02X", c);
+}
+
+/* keys of a "-" line, the next ones start a new line */
+#define SCRIPT_LINE_KEYS 64
+
+/* key read at this cycle, by a blocking read or not. Keys read ready
+ * follow each other on "-" lines.
+ */
+void script_rec(struct script_rec *r, unsigned long long cycle, int block,
+        unsigned char c)
+{
+    if (block) {
+        if (r->ready == SCRIPT_LINE_KEYS) {
+            fputc('\n', r->f);
+            r->ready = 0;
+        }
+        if (!r->ready)
+            fputs("- ", r->f);
+        r->ready++;
+        script_rec_put(r->f, c);
+    }
+    else {
+        if (r->ready)
+            fputc('\n', r->f);
+        r->ready = 0;
+        fprintf(r->f, "@%llu ", cycle);
+        script_rec_put(r->f, c);
+        fputc('\n', r->f);
+    }
+    /* a session can be killed */
+    fflush(r->f);
+}
+
+int script_rec_close(struct script_rec *r)
+{
+    int ret;
+
+    if (!r)
+        return 0;
+    if (r->ready)
+        fputc('\n', r->f);
+    ret = fclose(r->f) != 0;
+    free(r);
+    return ret;
+}
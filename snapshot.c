@@ -0,0 +1,239 @@
+/*
+ * Copyright (C) 2024 by Matthieu CASTET <castet.matthieu@free.fr>
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emu.h"
+
+/**
+ * Machine snapshot, taken between two instruction cycles.
+ *
+ * Only the state changed by running is saved : rom, constants and
+ * chip configuration come from the command line, that must be the
+ * same when loading the snapshot.
+ *
+ * format (native endian) :
+ *   "TI5XSNAP" uint32 version, uint32 number of chips
+ *   machine block
+ *   one block per chip (chips[] order)
+ * block : uint32 size, then size bytes
+ */
+
+#define SNAP_MAGIC "TI5XSNAP"
+#define SNAP_VERSION 4
+
+int snap_put(FILE *f, const void *data, size_t size)
+{
+    return fwrite(data, 1, size, f) != size;
+}
+
+int snap_get(FILE *f, void *data, size_t size)
+{
+    return fread(data, 1, size, f) != size;
+}
+
+/* bus and engine state */
+static int machine_save(void *priv, FILE *f)
+{
+    struct machine *m = priv;
+    struct bus *bus = &m->bus;
+    uint8_t dpt = bus->display_dpt, segH = bus->display_segH;
+    int ret = 0;
+
+    ret |= SNAP_PUT(f, bus->ext);
+    ret |= SNAP_PUT(f, bus->irg);
+    ret |= SNAP_PUT(f, bus->io);
+    ret |= SNAP_PUT(f, bus->display_digit);
+    ret |= SNAP_PUT(f, dpt);
+    ret |= SNAP_PUT(f, segH);
+    ret |= SNAP_PUT(f, bus->key_line);
+    ret |= SNAP_PUT(f, bus->dstate);
+    ret |= SNAP_PUT(f, bus->idle);
+    ret |= SNAP_PUT(f, bus->addr);
+    ret |= SNAP_PUT(f, m->cycle);
+    ret |= SNAP_PUT(f, m->irg_active);
+    ret |= SNAP_PUT(f, m->irg_left);
+    return ret;
+}
+
+static int machine_restore(void *priv, FILE *f)
+{
+    struct machine *m = priv;
+    struct bus *bus = &m->bus;
+    uint8_t dpt, segH;
+    int ret = 0;
+
+    ret |= SNAP_GET(f, bus->ext);
+    ret |= SNAP_GET(f, bus->irg);
+    ret |= SNAP_GET(f, bus->io);
+    ret |= SNAP_GET(f, bus->display_digit);
+    ret |= SNAP_GET(f, dpt);
+    ret |= SNAP_GET(f, segH);
+    ret |= SNAP_GET(f, bus->key_line);
+    ret |= SNAP_GET(f, bus->dstate);
+    ret |= SNAP_GET(f, bus->idle);
+    ret |= SNAP_GET(f, bus->addr);
+    ret |= SNAP_GET(f, m->cycle);
+    ret |= SNAP_GET(f, m->irg_active);
+    ret |= SNAP_GET(f, m->irg_left);
+    bus->display_dpt = dpt;
+    bus->display_segH = segH;
+    return ret;
+}
+
+/* write a block, the size is known once written */
+static int snap_block_save(FILE *f, int (*save)(void *priv, FILE *f),
+        void *priv)
+{
+    char *buf = NULL;
+    size_t size = 0;
+    uint32_t len;
+    FILE *mem = open_memstream(&buf, &size);
+    int ret;
+
+    if (!mem)
+        return 1;
+    ret = save ? save(priv, mem) : 0;
+    fclose(mem);
+    len = size;
+    ret |= SNAP_PUT(f, len);
+    ret |= snap_put(f, buf, size);
+    free(buf);
+    return ret;
+}
+
+/* read a block, it should be fully used by restore */
+static int snap_block_restore(FILE *f, int (*restore)(void *priv, FILE *f),
+        void *priv)
+{
+    uint32_t len;
+    char *buf;
+    FILE *mem;
+    int ret;
+
+    if (SNAP_GET(f, len))
+        return 1;
+    buf = malloc(len + 1);
+    if (!buf || snap_get(f, buf, len)) {
+        free(buf);
+        return 1;
+    }
+    mem = fmemopen(buf, len + 1, "r");
+    if (!mem) {
+        free(buf);
+        return 1;
+    }
+    ret = restore ? restore(priv, mem) : 0;
+    if (ftell(mem) != (long)len)
+        ret = 1;
+    fclose(mem);
+    free(buf);
+    return ret;
+}
+
+int snapshot_save(struct machine *m, const char *name)
+{
+    FILE *f = fopen(name, "wb");
+    uint32_t version = SNAP_VERSION;
+    uint32_t num = 0;
+    int ret = 0;
+
+    if (!f)
+        return 1;
+    while (m->chips[num].process)
+        num++;
+    ret |= snap_put(f, SNAP_MAGIC, 8);
+    ret |= SNAP_PUT(f, version);
+    ret |= SNAP_PUT(f, num);
+    ret |= snap_block_save(f, machine_save, m);
+    for (int i = 0; i < (int)num; i++)
+        ret |= snap_block_save(f, m->chips[i].save, m->chips[i].priv);
+    if (fclose(f))
+        ret = 1;
+    return ret;
+}
+
+/* snapshot in memory without the cycle count, to compare the state at
+ * two cycles (see steady.c). Return a malloced buffer, NULL on error.
+ */
+char *snapshot_state(struct machine *m, size_t *len)
+{
+    unsigned long long cycle = m->cycle;
+    char *buf = NULL;
+    FILE *mem = open_memstream(&buf, len);
+    int ret = 0;
+
+    if (!mem)
+        return NULL;
+    m->cycle = 0;
+    ret |= snap_block_save(mem, machine_save, m);
+    for (int i = 0; m->chips[i].process; i++)
+        ret |= snap_block_save(mem, m->chips[i].save, m->chips[i].priv);
+    m->cycle = cycle;
+    if (fclose(mem) || ret) {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+/* -W : called once the machine waits for a key */
+int snapshot_take(struct machine *m)
+{
+    int ret = snapshot_save(m, m->snap_save);
+
+    fprintf(m->out, "%s snapshot '%s' at cycle %llu\n",
+            ret ? "can't save" : "save", m->snap_save, m->cycle);
+    m->snap_save = NULL;
+    return ret;
+}
+
+/* machine must be set up with the same options */
+int snapshot_load(struct machine *m, const char *name)
+{
+    FILE *f = fopen(name, "rb");
+    char magic[8];
+    uint32_t version, num, n = 0;
+    int ret = 0;
+
+    if (!f) {
+        fprintf(m->out, "can't open snapshot '%s'\n", name);
+        return 1;
+    }
+    while (m->chips[n].process)
+        n++;
+    if (snap_get(f, magic, 8) || memcmp(magic, SNAP_MAGIC, 8) ||
+            SNAP_GET(f, version) || version != SNAP_VERSION ||
+            SNAP_GET(f, num) || num != n) {
+        fprintf(m->out, "snapshot '%s' is not for this machine\n", name);
+        fclose(f);
+        return 1;
+    }
+    ret |= snap_block_restore(f, machine_restore, m);
+    for (int i = 0; i < (int)num && !ret; i++) {
+        ret |= snap_block_restore(f, m->chips[i].restore, m->chips[i].priv);
+        if (ret)
+            fprintf(m->out, "snapshot '%s' : chip %d does not match\n",
+                    name, i);
+    }
+    fclose(f);
+    return ret;
+}
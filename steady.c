@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2024 by Matthieu CASTET <castet.matthieu@free.fr>
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emu.h"
+
+/**
+ * Steady state : without key read, display/printer output, and routed
+ * chips (ram, printer, card, ...), the machine only depends on its state.
+ * If the state at a scan start is the same as at an earlier scan start,
+ * the machine repeats this period until something reads a key : the
+ * fast engine jumps whole periods toward cycle_max instead of running
+ * them (a display loop in a "-n" run).
+ *
+ * The state is a snapshot in memory of the bus and all chips, without
+ * the cycle count. Periods are found with Brent cycle detection on the
+ * states at scan start. To take few snapshots, the state is compared
+ * only when the rom address is the one of the reference, and after a
+ * mismatch, not before twice the distance to the reference.
+ */
+
+/* scans without input/output before looking for a period */
+#define STEADY_QUIET 16
+/* longest period found, in scans */
+#define STEADY_POWER_MAX 4096
+
+void steady_reset(struct steady *s)
+{
+    free(s->image);
+    s->image = NULL;
+}
+
+/* this scan is the reference. image : its state, NULL if not taken */
+static void steady_ref(struct machine *m, char *image, size_t len)
+{
+    struct steady *s = &m->steady;
+
+    free(s->image);
+    if (!image)
+        image = snapshot_state(m, &len);
+    s->image = image;
+    s->len = len;
+    s->addr = m->bus.addr;
+    s->start = m->cycle;
+    if (m->pace)
+        s->pace_time = m->pace->time;
+    s->lam = 0;
+    s->min_lam = 1;
+}
+
+/* called by run_fast between two cycles, at scan start */
+void steady_scan(struct machine *m)
+{
+    struct steady *s = &m->steady;
+    char *image = NULL;
+    size_t len = 0;
+
+    if (s->io != m->io || s->routed) {
+        steady_reset(s);
+        s->io = m->io;
+        s->routed = 0;
+        s->next = m->cycle + STEADY_QUIET * 16;
+        return;
+    }
+    if (!s->image) {
+        if (m->cycle >= s->next) {
+            s->power = 1;
+            steady_ref(m, NULL, 0);
+        }
+        return;
+    }
+
+    s->lam++;
+    if (s->lam >= s->min_lam && m->bus.addr == s->addr) {
+        image = snapshot_state(m, &len);
+        if (image && len == s->len && !memcmp(image, s->image, len)) {
+            unsigned long long period = m->cycle - s->start;
+            /* -S : the snapshot may be past cycle_max */
+            unsigned long long n = m->cycle_max > m->cycle ?
+                (m->cycle_max - m->cycle - 1) / period : 0;
+
+            /* stop before cycle_max, run_fast returns there */
+            m->cycle += n * period;
+            /* with -x, sleep instead of running */
+            if (m->pace)
+                m->pace->time += n * (m->pace->time - s->pace_time);
+            free(image);
+            steady_reset(s);
+            /* less than a period left */
+            s->next = m->cycle_max;
+            return;
+        }
+        s->min_lam = 2 * s->lam;
+    }
+    if (s->lam >= s->power) {
+        if (s->power < STEADY_POWER_MAX)
+            s->power *= 2;
+        steady_ref(m, image, len);
+    }
+    else
+        free(image);
+}
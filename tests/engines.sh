@@ -0,0 +1,43 @@
+#! /bin/bash
+# S-state and fast engines give the same run of tests/keys.rom
+set -x
+set -e
+
+cd "$(dirname "$0")/.."
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+CHIPS="-r tests/keys.rom -p"
+KEYS="-K tests/keys.k"
+
+echo "lockstep"
+./main -X $CHIPS $KEYS < /dev/null > $TMP/check.txt
+grep "check : no divergence" $TMP/check.txt
+
+# batch report : exit code, cycles, display and printer tape
+report() {
+    echo "run /dev/null $CHIPS $KEYS $1" > $TMP/jobs.txt
+    shift
+    ./main "$@" --batch $TMP/jobs.txt
+}
+
+echo "fast engine"
+report "" > $TMP/sstate.txt
+report "" -F > $TMP/fast.txt
+grep "^exit 0$" $TMP/sstate.txt
+cmp $TMP/sstate.txt $TMP/fast.txt
+
+echo "fast engine with -n"
+report "" -F -n 100000000 > $TMP/fast_n.txt
+cmp $TMP/fast.txt $TMP/fast_n.txt
+report "" -n 20000 > $TMP/sstate_n.txt
+report "" -F -n 20000 > $TMP/fast_n.txt
+grep "^cycles 20000$" $TMP/sstate_n.txt
+cmp $TMP/sstate_n.txt $TMP/fast_n.txt
+
+echo "snapshot"
+./main $CHIPS -W $TMP/boot.snap < /dev/null > /dev/null
+for f in "" -F; do
+    report "" $f > $TMP/cold.txt
+    report "-S $TMP/boot.snap" $f > $TMP/snap.txt
+    cmp $TMP/cold.txt $TMP/snap.txt
+done
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2024 by Matthieu CASTET <castet.matthieu@free.fr>
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "emu.h"
+
+/**
+ * Binary trace : the alu state of the last instructions, in a ring buffer.
+ *
+ * One record per instruction, written at S0W (same state as the
+ * LOG_HRAST log). The ring is saved at the end of the run, or when the
+ * emulator is killed. tracedump render it as text.
+ *
+ * file format (native endian) :
+ *   struct trace_header
+ *   num records, oldest first
+ */
+
+struct trace *trace_new(unsigned long long size)
+{
+    struct trace *t = calloc(1, sizeof(*t));
+    unsigned long long num = 1;
+
+    if (!t)
+        return NULL;
+    /* power of 2 : index is a mask */
+    while (num < size)
+        num <<= 1;
+    t->rec = malloc(num * sizeof(*t->rec));
+    if (!t->rec) {
+        free(t);
+        return NULL;
+    }
+    t->mask = num - 1;
+    return t;
+}
+
+void trace_free(struct trace *t)
+{
+    if (!t)
+        return;
+    free(t->rec);
+    free(t);
+}
+
+static int write_all(int fd, const void *data, size_t size)
+{
+    const char *p = data;
+
+    while (size) {
+        ssize_t n = write(fd, p, size);
+        if (n <= 0)
+            return 1;
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/* only use async signal safe calls : can be called from a signal handler */
+int trace_save(struct trace *t, const char *name)
+{
+    struct trace_header h;
+    uint64_t size = t->mask + 1;
+    uint64_t first;
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int ret = 0;
+
+    if (fd < 0)
+        return 1;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+    h.version = TRACE_VERSION;
+    h.rec_size = sizeof(struct trace_rec);
+    h.count = t->count;
+    h.num = t->count < size ? t->count : size;
+    first = (t->count - h.num) & t->mask;
+
+    ret |= write_all(fd, &h, sizeof(h));
+    if (first + h.num > size) {
+        ret |= write_all(fd, &t->rec[first], (size - first) * sizeof(*t->rec));
+        ret |= write_all(fd, t->rec, (first + h.num - size) * sizeof(*t->rec));
+    }
+    else
+        ret |= write_all(fd, &t->rec[first], h.num * sizeof(*t->rec));
+    if (close(fd))
+        ret = 1;
+    return ret;
+}
@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2024 by Matthieu CASTET <castet.matthieu@free.fr>
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "emu.h"
+
+/**
+ * Render a binary trace (main -t) in the '-v' log format.
+ *
+ * The trace only has the alu state before each instruction : the result
+ * of an instruction is shown as the registers changed by the next record.
+ * Logs of the other chips are not in the trace.
+ */
+
+unsigned log_flags = LOG_SHORT;
+FILE *log_file;
+
+#define LOG_H(...)  fprintf (log_file, __VA_ARGS__)
+#define REG(r)  ((unsigned long long)(r))
+
+static void dump_hrast(const struct trace_rec *r)
+{
+    int i;
+
+    LOG_H ("A=%016llX B=%016llX C=%016llX D=%016llX E=%016llX",
+            REG(r->A), REG(r->B), REG(r->C), REG(r->D), REG(r->E));
+    LOG_H ("\nFA=%04X [", r->fA); for (i = 15; i >= 0; i--) LOG_H ("%d", (r->fA >> i) & 1);
+    LOG_H ("] KR=%04X [", r->KR); for (i = 15; i >= 0; i--) LOG_H ("%d", (r->KR >> i) & 1);
+    LOG_H ("] EXT=%02X COND=%d IDLE=%d", (r->EXT >> 4) & 0xFF, (r->state & TRACE_COND) != 0, (r->state & TRACE_IDLE) != 0);
+    LOG_H (" IOi=%016llX IO=%016llX", REG(r->Sin), REG(r->Sout));
+    LOG_H ("\nFB=%04X [", r->fB); for (i = 15; i >= 0; i--) LOG_H ("%d", (r->fB >> i) & 1);
+    LOG_H ("] SR=%04X R5=%X", r->SR, r->R5);
+    LOG_H ("\n");
+}
+
+/* alu instruction with IO destination */
+static int is_io(unsigned opcode)
+{
+    switch (opcode & 0x1F00) {
+        case 0x0000:
+        case 0x0800:
+        case 0x0A00:
+            return 0;
+    }
+    return !(opcode & 0x1000) && (opcode & 7) == 1;
+}
+
+/* state changed by the instruction of r */
+static void dump_changes(const struct trace_rec *r, const struct trace_rec *n)
+{
+    static const char name[] = "ABCDE";
+    const uint64_t *reg = &r->A, *next = &n->A;
+
+    for (int i = 0; i < 5; i++) {
+        if (reg[i] != next[i])
+            LOG ("%c=%016llX ", name[i], REG(next[i]));
+    }
+    if (r->fA != n->fA)
+        LOG ("FA=%04X ", n->fA);
+    if (r->fB != n->fB)
+        LOG ("FB=%04X ", n->fB);
+    if (r->KR != n->KR)
+        LOG ("KR=%04X ", n->KR);
+    if (r->SR != n->SR)
+        LOG ("SR=%04X ", n->SR);
+    if (r->R5 != n->R5)
+        LOG ("R5=%01X ", n->R5);
+    if ((r->state ^ n->state) & TRACE_IDLE)
+        LOG ("IDLE=%u ", (n->state & TRACE_IDLE) != 0);
+    if (is_io(r->opcode))
+        LOG ("IO=%016llX ", REG(n->Sout));
+}
+
+static void dump(const struct trace_rec *r, const struct trace_rec *next)
+{
+    DIS ("\n");
+    if (log_flags & LOG_SHORT)
+        DIS ("%04X:%c%c%c.D%02d\t%04X\t", r->addr,
+                (r->state & TRACE_COND) ? 'C' : '-',
+                (r->state & TRACE_IDLE) ? 'I' : '-',
+                (r->state & TRACE_HOLD) ? 'H' : '-',
+                r->digit,
+                r->opcode);
+    else
+        if (log_flags & LOG_HRAST)
+            DIS ("%04X %04X ", r->addr, r->opcode);
+    disasm (r->addr, r->opcode);
+    DIS ("\n");
+    if (log_flags & LOG_HRAST)
+        dump_hrast(r);
+    else {
+        LOG ("\t");
+        if (next)
+            dump_changes(r, next);
+    }
+}
+
+static void help(void)
+{
+    printf("tracedump [-v level] [-c] trace_file\n");
+    printf("-v level: log level of main, 1 (default), 2 (hrast) or 3\n");
+    printf("-c: print instruction cycle of each record\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct trace_header h;
+    struct trace_rec r[2];
+    int cycle = 0;
+    int opt;
+    FILE *f;
+
+    log_file = stdout;
+    while ((opt = getopt(argc, argv, "v:c")) != -1) {
+        switch (opt) {
+        case 'v':
+            log_flags = atoi(optarg);
+            break;
+        case 'c':
+            cycle = 1;
+            break;
+        default:
+            help();
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        help();
+        return 1;
+    }
+    f = fopen(argv[optind], "rb");
+    if (!f) {
+        printf("can't open trace '%s'\n", argv[optind]);
+        return 1;
+    }
+    if (fread(&h, sizeof(h), 1, f) != 1 ||
+            memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)) ||
+            h.version != TRACE_VERSION || h.rec_size != sizeof(r[0])) {
+        printf("'%s' is not a trace file\n", argv[optind]);
+        fclose(f);
+        return 1;
+    }
+    printf("trace : last %llu of %llu instructions\n",
+            (unsigned long long)h.num, (unsigned long long)h.count);
+
+    for (uint64_t i = 0; i < h.num; i++) {
+        struct trace_rec *cur = &r[i & 1];
+        if (fread(cur, sizeof(*cur), 1, f) != 1) {
+            printf("\ntruncated trace\n");
+            break;
+        }
+        if (i) {
+            if (cycle)
+                printf("\ncycle %llu", (unsigned long long)r[!(i & 1)].cycle);
+            dump(&r[!(i & 1)], cur);
+        }
+        if (i == h.num - 1) {
+            if (cycle)
+                printf("\ncycle %llu", (unsigned long long)cur->cycle);
+            dump(cur, NULL);
+        }
+    }
+    printf("\n");
+    fclose(f);
+    return 0;
+}
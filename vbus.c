@@ -20,66 +20,419 @@
 
 #include "bus.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
 #include "bus.h"
 #include "emu.h"
 
 unsigned log_flags = 0;
 FILE *log_file;
 
-#define CHIPS_NUM_MAX 55
-struct chip chipss[CHIPS_NUM_MAX] = {
-    {.process = NULL},
-};
+struct machine *machine_new(void)
+{
+    struct machine *m = calloc(1, sizeof(*m));
+
+    if (!m)
+        return NULL;
+    m->in_fd = 0;
+    m->out = stdout;
+    return m;
+}
+
+void machine_free(struct machine *m)
+{
+    if (!m)
+        return;
+    for (int i = 0; m->chips[i].process; i++) {
+        if (m->chips[i].destroy)
+            m->chips[i].destroy(m->chips[i].priv);
+        else
+            free(m->chips[i].priv);
+    }
+    trace_free(m->trace);
+    steady_reset(&m->steady);
+    free(m->pace);
+    script_free(m->script);
+    script_rec_close(m->record);
+    free(m->profile);
+    free(m->latency);
+    free(m->coverage);
+    free(m);
+}
+
+static void build_slots(struct machine *m)
+{
+    struct chip *chips = m->chips;
+
+    memset(m->slots, 0, sizeof(m->slots));
+    for (int i = 0; chips[i].process; i++) {
+        uint32_t mask = chips[i].slots ? chips[i].slots : SLOT_ALL;
+        for (int s = 0; s < 16; s++) {
+            for (int w = 0; w < 2; w++) {
+                if (mask & SLOT(s, w))
+                    m->slots[s][w] |= 1ULL << i;
+            }
+        }
+    }
+}
+
+static void build_route(struct machine *m)
+{
+    struct chip *chips = m->chips;
+
+    memset(m->irg_route, 0, sizeof(m->irg_route));
+    m->irg_routed = 0;
+    m->irg_active = 0;
+    for (int i = 0; chips[i].process; i++) {
+        const struct chip_irg *p = chips[i].irg;
+        if (!p)
+            continue;
+        m->irg_routed |= 1ULL << i;
+        for (; p->mask; p++) {
+            for (unsigned irg = 0; irg < IRG_NUM; irg++) {
+                if ((irg & p->mask) == p->value)
+                    m->irg_route[irg] |= 1ULL << i;
+            }
+        }
+    }
+}
+
+static inline int run_slot(struct machine *m, uint64_t slot)
+{
+    struct chip *chips = m->chips;
+    /* skip routed chips that are not waiting for this instruction */
+    uint64_t mask = slot & ~(m->irg_routed & ~m->irg_active);
+
+    while (mask) {
+        int i = __builtin_ctzll(mask);
+        int ret = chips[i].process(chips[i].priv, &m->bus);
+        if (ret) {
+            if (ret != RUN_END_OF_INPUT)
+                fprintf(m->out, "%d error %d\n", i, ret);
+            return ret;
+        }
+        mask &= mask - 1;
+    }
+    return 0;
+}
 
-struct bus bus_state;
+/* wake up chips decoding current instruction (S15R) */
+static inline void route_irg(struct machine *m)
+{
+    uint64_t match = m->irg_route[m->bus.irg & (IRG_NUM - 1)];
+
+    m->irg_active |= match;
+    while (match) {
+        int i = __builtin_ctzll(match);
+        m->irg_left[i] = m->chips[i].irg_delay;
+        match &= match - 1;
+    }
+}
 
-int run(struct chip chips[], struct bus *bus)
+/* end of instruction : put back to sleep chips with nothing pending */
+static inline void route_end(struct machine *m)
 {
+    uint64_t active = m->irg_active;
+
+    while (active) {
+        int i = __builtin_ctzll(active);
+        if (m->irg_left[i]-- <= 0)
+            m->irg_active &= ~(1ULL << i);
+        active &= active - 1;
+    }
+}
+
+static inline void cycle_start(struct bus *bus)
+{
+    bus->ext = 0;
+    bus->irg = 0;
+    bus->addr = -1;
+    memset(bus->io, 0, sizeof(bus->io));
+}
 
+/* dstate is updated between S14R/S15W */
+static inline void next_digit(struct bus *bus)
+{
+    bus->key_line = 0;
+    if (bus->dstate)
+        bus->dstate--;
+    else
+        bus->dstate = 15;
+}
+
+/* once started, run and run_fast resume the machine */
+static int run_init(struct machine *m)
+{
+    struct bus *bus = &m->bus;
+
+    if (m->started)
+        return 0;
+    m->started = 1;
     memset(bus, 0, sizeof(*bus));
     bus->dstate = 15;
     bus->display_digit = ' ';
+    bus->machine = m;
+    m->cycle = 0;
+    build_slots(m);
+    build_route(m);
+    if (m->snap_load)
+        return snapshot_load(m, m->snap_load);
+    return 0;
+}
+
+int run(struct machine *m)
+{
+    struct bus *bus = &m->bus;
+
+    if (run_init(m))
+        return 1;
 
     while (1) {
-        bus->ext = 0;
-        bus->irg = 0;
-        bus->addr = -1;
-        memset(bus->io, 0, sizeof(bus->io));
+        cycle_start(bus);
         for (bus->sstate = 0; bus->sstate < 16; bus->sstate++) {
             int ret;
             bus->write = 1;
-            for (int i = 0; chips[i].process; i++) {
-                ret = chips[i].process(chips[i].priv, bus);
-                if (ret) {
-                    printf("%d error %d\n", i, ret);
-                    return ret;
-                }
-            }
+            ret = run_slot(m, m->slots[bus->sstate][1]);
+            if (ret)
+                return ret;
             bus->write = 0;
-            for (int i = 0; chips[i].process; i++) {
-                ret = chips[i].process(chips[i].priv, bus);
-                if (ret) {
-                    printf("%d error %d\n", i, ret);
-                    return ret;
-                }
+            if (bus->sstate == 15)
+                route_irg(m);
+            ret = run_slot(m, m->slots[bus->sstate][0]);
+            if (ret)
+                return ret;
+            if (bus->sstate == 14)
+                next_digit(bus);
+        }
+        route_end(m);
+        if (++m->cycle >= m->cycle_max && m->cycle_max)
+            return 0;
+        if (m->pace)
+            pace_cycle(m->pace, bus->idle);
+        if (m->check_out)
+            check_cycle(m);
+        if (log_flags & LOG_SHORT)
+            LOG(" EXT=0x%04x IRG=0x%04x\n", bus->ext, bus->irg);
+        if (m->key_wait) {
+            m->key_wait = 0;
+            return RUN_KEY_WAIT;
+        }
+    }
+    return 0;
+}
+
+/* fast engine : one call per chip and phase, see chip->step */
+static inline int run_step(struct machine *m, uint64_t slot)
+{
+    struct chip *chips = m->chips;
+    uint64_t mask = slot & ~(m->irg_routed & ~m->irg_active);
+
+    while (mask) {
+        int i = __builtin_ctzll(mask);
+        int ret = m->step_fn[i](chips[i].priv, &m->bus);
+        if (ret) {
+            if (ret != RUN_END_OF_INPUT)
+                fprintf(m->out, "%d error %d\n", i, ret);
+            return ret;
+        }
+        mask &= mask - 1;
+    }
+    return 0;
+}
+
+/* fast engine : the alu repeats an instruction holding the bus (key
+ * scan with no key, wait digit). Only the digit changes : the rom output the same
+ * irg/addr and routed chips are asleep, so only the chips with a hold
+ * function run, until the alu stops holding (the cycle is then run by
+ * run_fast). The alu is the first chip, nothing has changed when it stops.
+ * Return 1 at cycle_max, RUN_END_OF_INPUT when the keys are over, < 0 on
+ * a chip error.
+ */
+static int run_hold(struct machine *m)
+{
+    struct chip *chips = m->chips;
+    struct bus *bus = &m->bus;
+    uint16_t irg = bus->irg;
+    int addr = bus->addr;
+
+    while (1) {
+        uint64_t mask;
+
+        bus->ext = 0;
+        bus->irg = irg;
+        bus->addr = addr;
+        memset(bus->io, 0, sizeof(bus->io));
+        bus->write = 0;
+        bus->sstate = 0;
+        for (mask = m->hold_chips; mask; mask &= mask - 1) {
+            int i = __builtin_ctzll(mask);
+            int ret = chips[i].hold(chips[i].priv, bus);
+            if (ret > 0)
+                return 0;
+            if (ret) {
+                fprintf(m->out, "%d error %d\n", i, ret);
+                return ret;
             }
-            /* dstate is updated between S14R/S15W */
-            if (bus->sstate == 14) {
-                bus->key_line = 0;
-                if (bus->dstate)
-                    bus->dstate--;
-                else
-                    bus->dstate = 15;
+        }
+        next_digit(bus);
+        bus->sstate = 15;
+        for (mask = m->hold_chips; mask; mask &= mask - 1) {
+            int i = __builtin_ctzll(mask);
+            int ret = chips[i].hold(chips[i].priv, bus);
+            if (ret == RUN_END_OF_INPUT)
+                return ret;
+            if (ret) {
+                fprintf(m->out, "%d error %d\n", i, ret);
+                return ret < 0 ? ret : -1;
             }
         }
+        if (++m->cycle >= m->cycle_max && m->cycle_max)
+            return 1;
+        if (m->pace)
+            pace_cycle(m->pace, bus->idle);
+    }
+}
+
+int run_fast(struct machine *m)
+{
+    struct chip *chips = m->chips;
+    struct bus *bus = &m->bus;
+    uint64_t step_w = 0, step_r = 0;
+    /* hold cycles are not logged/checked/traced/profiled */
+    int hold_ok = chips[0].hold && !log_flags && !m->check_out &&
+        !m->trace && !m->profile;
+    /* steady state jumps toward cycle_max, all the chips running
+     * without routing must be in the snapshot
+     */
+    int steady_ok = hold_ok && m->cycle_max;
+
+    if (run_init(m))
+        return 1;
+
+    for (int s = 0; s < 15; s++) {
+        step_w |= m->slots[s][1];
+        step_r |= m->slots[s][0];
+    }
+    for (int i = 0; chips[i].process; i++) {
+        uint32_t mask = chips[i].slots ? chips[i].slots : SLOT_ALL;
+        if (chips[i].hold)
+            m->hold_chips |= 1ULL << i;
+        if (!chips[i].save && !(m->irg_routed & (1ULL << i)))
+            steady_ok = 0;
+        m->step_fn[i] = chips[i].step;
+        if (m->step_fn[i])
+            continue;
+        if (mask & ~(SLOT(0, 0) | SLOT(0, 1) | SLOT(15, 0) | SLOT(15, 1))) {
+            fprintf(m->out, "chip %d has no instruction level model\n", i);
+            return 1;
+        }
+        m->step_fn[i] = chips[i].process;
+    }
+
+    while (1) {
+        int ret, hold;
+        if (steady_ok && bus->dstate == 15)
+            steady_scan(m);
+        cycle_start(bus);
+        bus->sstate = 0;
+        bus->write = 1;
+        ret = run_step(m, step_w);
+        if (ret)
+            return ret;
+        bus->write = 0;
+        ret = run_step(m, step_r);
+        if (ret)
+            return ret;
+        next_digit(bus);
+        bus->sstate = 15;
+        bus->write = 1;
+        ret = run_step(m, m->slots[15][1]);
+        if (ret)
+            return ret;
+        bus->write = 0;
+        route_irg(m);
+        ret = run_step(m, m->slots[15][0]);
+        if (ret)
+            return ret;
+        /* no routed chip ran in this cycle, nor will in the next one */
+        hold = hold_ok && (bus->ext & EXT_HOLD) && !m->irg_active;
+        if (m->irg_active)
+            m->steady.routed = 1;
+        route_end(m);
+        if (++m->cycle >= m->cycle_max && m->cycle_max)
+            return 0;
+        if (m->pace)
+            pace_cycle(m->pace, bus->idle);
+        if (m->check_out)
+            check_cycle(m);
         if (log_flags & LOG_SHORT)
             LOG(" EXT=0x%04x IRG=0x%04x\n", bus->ext, bus->irg);
+        if (m->key_wait) {
+            m->key_wait = 0;
+            return RUN_KEY_WAIT;
+        }
+        if (hold && !m->irg_route[bus->irg & (IRG_NUM - 1)]) {
+            ret = run_hold(m);
+            if (ret == 1)
+                return 0;
+            if (ret)
+                return ret;
+        }
     }
     return 0;
 }
 
+/* merge the coverage of this run in the -C file */
+static void machine_coverage_save(struct machine *m)
+{
+    struct coverage *c = m->coverage;
+
+    for (int i = 0; m->chips[i].process; i++) {
+        if (m->chips[i].coverage)
+            m->chips[i].coverage(m->chips[i].priv, c);
+    }
+    if (coverage_merge(c, m->coverage_name)) {
+        fprintf(m->out, "can't save coverage '%s'\n", m->coverage_name);
+        return;
+    }
+    fprintf(m->out, "coverage '%s' : ", m->coverage_name);
+    coverage_summary(c, m->out);
+}
+
+/* run, save snapshot (-W) when the machine first waits for a key,
+ * and trace (-t) at the end
+ */
+int machine_run(struct machine *m, int fast)
+{
+    int ret;
+
+    if (m->snap_save)
+        m->stop_key_wait = 1;
+    while (1) {
+        ret = fast ? run_fast(m) : run(m);
+        if (ret != RUN_KEY_WAIT)
+            break;
+        if (m->snap_save && snapshot_take(m)) {
+            ret = 1;
+            break;
+        }
+    }
+    if (ret == RUN_END_OF_INPUT)
+        ret = 0;
+    if (m->trace && trace_save(m->trace, m->trace_name))
+        fprintf(m->out, "can't save trace '%s'\n", m->trace_name);
+    if (m->profile && profile_save(m->profile, m->profile_name))
+        fprintf(m->out, "can't save profile '%s'\n", m->profile_name);
+    if (m->latency && latency_save(m->latency, m->job))
+        fprintf(m->out, "can't save latency '%s'\n", m->latency->name);
+    if (m->coverage)
+        machine_coverage_save(m);
+    return ret;
+}
+
 static void help(void)
 {
     printf("-r file: add rom file\n");
@@ -93,47 +446,50 @@ static void help(void)
     printf("-d: disassemble rom on stderr and exit\n");
     printf("-D: disassemble crom on stderr and exit\n");
     printf("-v: verbose log in log.txt\n");
+    printf("-L: drop log instead of slowing down when the disk is too slow\n");
+    printf("-F: fast instruction level engine\n");
+    printf("-X: run S-state and fast engine in lockstep and stop on first difference\n");
+    printf("-n cycles: stop after this number of instruction cycles\n");
+    printf("-S file: start from snapshot file (same chip options)\n");
+    printf("-W file: save snapshot file at first key wait\n");
+    printf("-t file: save binary trace of last instructions, see tracedump\n");
+    printf("-T num: number of instructions in trace (default 1048576)\n");
+    printf("-A file: save execution count and time per rom address\n");
+    printf("-C file: merge rom/crom coverage in file, see covdump\n");
+    printf("-x speed: run at speed times the calculator speed (1: real speed)\n");
+    printf("-K file: read keys from a key script instead of stdin, see README\n");
+    printf("-Y file: record the keys read in a key script\n");
+    printf("-H file: save key to result latency histograms (also on SIGUSR1)\n");
+    printf("-I: read keys only when the calculator is ready, as fast as it accepts them\n");
+    printf("--batch file (-b): run the jobs listed in file, see README\n");
+    printf("-j num: number of threads for --batch\n");
+    printf("--fork: with --batch, run jobs as forks of booted machines\n");
 }
 
-int main(int argc, char *argv[])
+static const char options[] = "r:s:k:RmpPl:c:dDv:LFXn:b:j:S:W:t:T:A:C:x:K:Y:IH:";
+
+/* add chips from command line options (second pass).
+ * Not reentrant (getopt).
+ * return 0 on success, -1 if disassemble only
+ */
+int machine_setup(struct machine *m, int argc, char *argv[],
+        int disasm, int disasm_crom)
 {
+    struct chip *chipss = m->chips;
     int opt;
     int i = 0;
     int ret = 0;
     int ram_addr = 0;
-    int disasm = 0;
-    int disasm_crom = 0;
     enum hw hw_opt = 0;
     char *keyb_name = NULL;
-    const char *options = "r:s:k:RmpPl:c:dDv:";
-
-    /* first pass for debug options */
-    while ((opt = getopt(argc, argv, options)) != -1) {
-        switch (opt) {
-        case 'd':
-            disasm = 1;
-            break;
-        case 'D':
-            disasm_crom = 1;
-            break;
-        case 'v':
-            log_flags = atoi(optarg);
-            break;
-        default:
-            break;
-        }
-    }
-    log_file = stdout;
-    if (log_flags) {
-        FILE *f = fopen("log.txt", "a");
-        if (f)
-            log_file = f;
-    }
-
+    unsigned long long trace_size = 1 << 20;
+    double speed = 0;
+    const char *latency_name = NULL;
 
     optind = 1;
 
-    ret |= alu_init(&chipss[i++]);
+    /* without log, use the alu built without trace code */
+    ret |= (log_flags ? alu_init : alu_init_notrace)(&chipss[i++]);
     while ((opt = getopt(argc, argv, options)) != -1) {
         switch (opt) {
         case 'r':
@@ -165,10 +521,56 @@ int main(int argc, char *argv[])
         case 'c':
             ret |= crd_init(&chipss[i++], optarg);
             break;
+        case 'S':
+            m->snap_load = optarg;
+            break;
+        case 'W':
+            m->snap_save = optarg;
+            break;
+        case 't':
+            m->trace_name = optarg;
+            break;
+        case 'T':
+            trace_size = strtoull(optarg, NULL, 0);
+            break;
+        case 'A':
+            m->profile_name = optarg;
+            break;
+        case 'C':
+            m->coverage_name = optarg;
+            break;
+        case 'x':
+            speed = strtod(optarg, NULL);
+            break;
+        case 'K':
+            script_free(m->script);
+            m->script = script_load(optarg);
+            if (!m->script)
+                ret = 1;
+            break;
+        case 'I':
+            m->key_inject = 1;
+            break;
+        case 'H':
+            latency_name = optarg;
+            break;
+        case 'Y':
+            script_rec_close(m->record);
+            m->record = script_rec_open(optarg);
+            if (!m->record)
+                ret = 1;
+            break;
+        /* ignore run options, see main */
+        case 'F':
+        case 'X':
+        case 'n':
+        case 'b':
+        case 'j':
         /*ignore debug */
         case 'd':
         case 'D':
         case 'v':
+        case 'L':
             break;
         default:
             help();
@@ -181,17 +583,151 @@ int main(int argc, char *argv[])
         return 1;
 
     if (disasm || disasm_crom) {
-        return 0;
+        return -1;
     }
 
     if (i + 2 > CHIPS_NUM_MAX)
         return 2;
 
     ret |= aux_init(&chipss[i++], keyb_name);
-    ret |= display_init(&chipss[i++], keyb_name);
-    ret |= key_init(&chipss[i++], keyb_name, hw_opt);
+    ret |= display_init(m, &chipss[i++], keyb_name);
+    ret |= key_init(m, &chipss[i++], keyb_name, hw_opt);
+
+    if (m->trace_name && !ret) {
+        m->trace = trace_new(trace_size);
+        if (!m->trace)
+            ret = 1;
+    }
+    if (m->profile_name && !ret) {
+        m->profile = profile_new();
+        if (!m->profile)
+            ret = 1;
+    }
+    if (m->coverage_name && !ret) {
+        m->coverage = coverage_new();
+        if (!m->coverage)
+            ret = 1;
+    }
+    if (latency_name && !ret) {
+        m->latency = latency_new(keyb_name ? keyb_name : "sr50",
+                latency_name);
+        if (!m->latency)
+            ret = 1;
+    }
+    if (speed > 0 && !ret) {
+        m->pace = pace_new(speed);
+        if (!m->pace)
+            ret = 1;
+    }
 
     printf("number of chip %d\n", i);
-    run(chipss, &bus_state);
-    return 0;
+    return ret ? 1 : 0;
+}
+
+/* save the trace and the log when killed or crashing */
+static struct machine *exit_machine;
+
+static void exit_signal(int sig)
+{
+    if (exit_machine->trace)
+        trace_save(exit_machine->trace, exit_machine->trace_name);
+    log_signal_flush();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static void exit_signals(struct machine *m)
+{
+    static const int sigs[] = {SIGINT, SIGTERM, SIGQUIT, SIGSEGV, SIGBUS,
+        SIGABRT, SIGFPE};
+
+    exit_machine = m;
+    for (unsigned i = 0; i < sizeof(sigs) / sizeof(sigs[0]); i++)
+        signal(sigs[i], exit_signal);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option long_options[] = {
+        {"batch", required_argument, NULL, 'b'},
+        {"fork", no_argument, NULL, 'f'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    int ret = 0;
+    int disasm = 0;
+    int disasm_crom = 0;
+    int fast = 0;
+    int check = 0;
+    unsigned long long cycle_max = 0;
+    const char *batch = NULL;
+    int threads = 1;
+    int pool = 0;
+    int log_drop = 0;
+    struct machine *m;
+
+    /* first pass for debug and run options */
+    while ((opt = getopt_long(argc, argv, options, long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'd':
+            disasm = 1;
+            break;
+        case 'D':
+            disasm_crom = 1;
+            break;
+        case 'v':
+            log_flags = atoi(optarg);
+            break;
+        case 'L':
+            log_drop = 1;
+            break;
+        case 'F':
+            fast = 1;
+            break;
+        case 'X':
+            check = 1;
+            break;
+        case 'n':
+            cycle_max = strtoull(optarg, NULL, 0);
+            break;
+        case 'b':
+            batch = optarg;
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 'f':
+            pool = 1;
+            break;
+        default:
+            break;
+        }
+    }
+    log_file = stdout;
+    if (batch) {
+        /* threads can't share the log */
+        log_flags = 0;
+        return batch_run(batch, threads, fast, cycle_max, pool);
+    }
+    if (log_flags)
+        log_open("log.txt", log_drop);
+
+    m = machine_new();
+    if (!m)
+        return 1;
+    m->cycle_max = cycle_max;
+    ret = machine_setup(m, argc, argv, disasm, disasm_crom);
+    if (ret) {
+        machine_free(m);
+        return ret < 0 ? 0 : ret;
+    }
+
+    if (m->trace || log_flags)
+        exit_signals(m);
+    if (check)
+        ret = check_run(m);
+    else
+        machine_run(m, fast);
+    machine_free(m);
+    return ret;
 }